@@ -55,6 +55,15 @@ PCRE = {
         incdirs = {"$(PCRE_INCDIR)"},
         libdirs = {"$(PCRE_LIBDIR)"}
       }
+    },
+    platforms = {
+      unix = {
+        modules = {
+          rex_pcre = {
+            libraries = {"pcre", "pthread"}
+          }
+        }
+      }
     }
   }
 },
@@ -76,6 +85,15 @@ PCRE2 = {
         incdirs = {"$(PCRE2_INCDIR)"},
         libdirs = {"$(PCRE2_LIBDIR)"}
       }
+    },
+    platforms = {
+      unix = {
+        modules = {
+          rex_pcre2 = {
+            libraries = {"pcre2-8", "pthread"}
+          }
+        }
+      }
     }
   }
 },
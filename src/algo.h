@@ -6,24 +6,34 @@
 #define REX_VERSION "Lrexlib " VERSION
 
 /* Forward declarations */
-static void gmatch_pushsubject (lua_State *L, TArgExec *argE);
+static void gmatch_pushsubject (lua_State *L, TArgExec *argE, int pos);
 static int findmatch_exec  (TUserdata *ud, TArgExec *argE);
-static int split_exec      (TUserdata *ud, TArgExec *argE, int offset);
-static int gsub_exec       (TUserdata *ud, TArgExec *argE, int offset);
+static int split_exec      (TUserdata *ud, TArgExec *argE, size_t offset);
+static int gsub_exec       (TUserdata *ud, TArgExec *argE, size_t offset);
 static int gmatch_exec     (TUserdata *ud, TArgExec *argE);
 static int compile_regex   (lua_State *L, const TArgComp *argC, TUserdata **pud);
 static int generate_error  (lua_State *L, const TUserdata *ud, int errcode);
 
 #if LUA_VERSION_NUM == 501
 #  define ALG_ENVIRONINDEX LUA_ENVIRONINDEX
+#  define alg_getuservalue lua_getfenv
+#  define alg_setuservalue lua_setfenv
 #else
 #  define ALG_ENVIRONINDEX lua_upvalueindex(1)
+#  define alg_getuservalue lua_getuservalue
+#  define alg_setuservalue lua_setuservalue
 #endif
 
 #ifndef ALG_CHARSIZE
 #  define ALG_CHARSIZE 1
 #endif
 
+/* ALG_CHARLEN(ud,text,len,pos) is the number of the bytes of the character at
+   text[pos], stepped over after an empty match there */
+#ifndef ALG_CHARLEN
+#  define ALG_CHARLEN(ud,text,len,pos) ALG_CHARSIZE
+#endif
+
 #ifndef BUFFERZ_PUTREPSTRING
 #  define BUFFERZ_PUTREPSTRING bufferZ_putrepstring
 #endif
@@ -32,14 +42,65 @@ static int generate_error  (lua_State *L, const TUserdata *ud, int errcode);
 #  define ALG_GETCARGS(a,b,c)
 #endif
 
-#ifndef DO_NAMED_SUBPATTERNS
-#define DO_NAMED_SUBPATTERNS(a,b,c)
+/* ALG_NAMES(ud), if defined, is the registry reference of the names table of
+   the regex (see names_add), or 0 if the regex has no named subpatterns */
+#ifdef ALG_NAMES
+static void do_named_subpatterns (lua_State *L, TUserdata *ud, const char *text);
+#  define DO_NAMED_SUBPATTERNS do_named_subpatterns
+#else
+#  define DO_NAMED_SUBPATTERNS(a,b,c)
+#endif
+
+#ifndef ALG_CACHE_PUSHLARG
+#  define ALG_CACHE_PUSHLARG(L,argC) 0
+#endif
+
+#ifndef ALG_CACHE_FREEARGS
+#  define ALG_CACHE_FREEARGS(argC)
+#endif
+
+#ifndef ALG_CACHE_SIZEOF
+#  define ALG_CACHE_SIZEOF(ud) sizeof (TUserdata)
 #endif
 
+/* ALG_GSUB_FAST (L, ud, argE, BufRep, &n_subst), if defined, may make all the
+   substitutions of gsub with a string template at once. It returns 0 if it
+   did not, a positive value after pushing the resulting string, or a negative
+   error code. */
+
+/* called once per subject before the matches are made on it */
+#ifndef ALG_PREPARE_SUBJECT
+#  define ALG_PREPARE_SUBJECT(L,ud,argE,pos) ((void)(ud))
+#endif
+
+/* finds whether there is a match, when neither the match nor the captures are
+   needed; returns a result in the same codes as findmatch_exec */
+#ifndef ALG_TEST_EXEC
+#  define ALG_TEST_EXEC(ud,argE) findmatch_exec (ud, argE)
+#endif
+
+/* Default limits of the compiled-pattern cache */
+#ifndef REX_CACHE_CAPACITY
+#  define REX_CACHE_CAPACITY 64
+#endif
+#ifndef REX_CACHE_MAXBYTES
+#  define REX_CACHE_MAXBYTES (4 * 1024 * 1024)
+#endif
+
+/* Location of the compiled-pattern cache in the function environment;
+   library-specific tables use small positive indices */
+#define ALG_INDEX_CACHE  0
+#define ALG_INDEX_MATCH_META  -1   /* match objects' metatable */
+
 #define METHOD_FIND  0
 #define METHOD_MATCH 1
 #define METHOD_EXEC  2
 #define METHOD_TFIND 3
+#define METHOD_TEST  4
+#define METHOD_SEARCH 5
+
+/* an offset that is none, e.g. the end of the previous match before the first */
+#define ALG_NOPOS ((size_t)-1)
 
 
 static int OptLimit (lua_State *L, int pos) {
@@ -55,16 +116,42 @@ static int OptLimit (lua_State *L, int pos) {
 }
 
 
-static int get_startoffset(lua_State *L, int stackpos, size_t len) {
-  int startoffset = (int)luaL_optinteger(L, stackpos, 1);
+/* position of the optional table to receive the results, or 0 */
+static int OptResultTable (lua_State *L, int pos) {
+  if (lua_isnoneornil (L, pos))
+    return 0;
+  luaL_checktype (L, pos, LUA_TTABLE);
+  return pos;
+}
+
+
+/* Pushes the table at outpos to be refilled with n array items, or a new
+   table if outpos is 0. The items past n are removed; other fields are kept,
+   so that those of the named subpatterns get overwritten in place. */
+static void push_result_table (lua_State *L, int outpos, int n) {
+  if (outpos) {
+    int i;
+    lua_pushvalue (L, outpos);
+    for (i = (int)lua_objlen (L, -1); i > n; i--) {
+      lua_pushnil (L);
+      lua_rawseti (L, -2, i);
+    }
+  }
+  else
+    lua_createtable (L, n, 0);
+}
+
+
+static size_t get_startoffset(lua_State *L, int stackpos, size_t len) {
+  lua_Integer startoffset = luaL_optinteger(L, stackpos, 1);
   if(startoffset > 0)
     startoffset--;
   else if(startoffset < 0) {
-    startoffset += len/ALG_CHARSIZE;
+    startoffset += (lua_Integer)(len/ALG_CHARSIZE);
     if(startoffset < 0)
       startoffset = 0;
   }
-  return startoffset*ALG_CHARSIZE;
+  return (size_t)startoffset*ALG_CHARSIZE;
 }
 
 
@@ -98,6 +185,20 @@ static void check_subject (lua_State *L, int pos, TArgExec *argE)
     luaL_typerror (L, pos, "string, table or userdata");
   } else if (argE->text == NULL) {
     int type;
+    if (lua_getmetatable (L, pos)) {
+      const TRexBuffer *rb = NULL;
+      lua_pushliteral (L, REX_BUFFER_KEY);
+      lua_rawget (L, -2);
+      if (lua_type (L, -1) == LUA_TLIGHTUSERDATA)
+        rb = (const TRexBuffer*) lua_touserdata (L, -1);
+      lua_pop (L, 2);
+      if (rb != NULL) {
+        argE->text = rb->getbuffer (L, pos, &argE->textlen);
+        if (argE->text == NULL)
+          luaL_error (L, "subject's buffer is not available");
+        return;
+      }
+    }
     lua_getfield (L, pos, "topointer");
     if (lua_type (L, -1) != LUA_TFUNCTION)
       luaL_error (L, "subject has no topointer method");
@@ -172,6 +273,8 @@ static void checkarg_count (lua_State *L, TArgComp *argC, TArgExec *argE) {
 
 /* function find  (s, patt, [st], [cf], [ef], [larg...]) */
 /* function match (s, patt, [st], [cf], [ef], [larg...]) */
+/* function test  (s, patt, [st], [cf], [ef], [larg...]) */
+/* function search (s, patt, [st], [cf], [ef], [larg...]) */
 static void checkarg_find_func (lua_State *L, TArgComp *argC, TArgExec *argE) {
   check_subject (L, 1, argE);
   check_pattern (L, 2, argC);
@@ -193,10 +296,23 @@ static void checkarg_gmatch_split (lua_State *L, TArgComp *argC, TArgExec *argE)
 }
 
 
-/* method r:tfind (s, [st], [ef]) */
-/* method r:exec  (s, [st], [ef]) */
+/* function find_all (s, patt, [cf], [ef], [max], [caps], [larg...]) */
+static void checkarg_find_all (lua_State *L, TArgComp *argC, TArgExec *argE) {
+  check_subject (L, 1, argE);
+  check_pattern (L, 2, argC);
+  argC->cflags = ALG_GETCFLAGS (L, 3);
+  argE->eflags = (int)luaL_optinteger (L, 4, ALG_EFLAGS_DFLT);
+  argE->maxmatch = (int)luaL_optinteger (L, 5, GSUB_UNLIMITED);
+  ALG_GETCARGS (L, 7, argC);
+}
+
+
+/* method r:tfind (s, [st], [ef], [out]) */
+/* method r:exec  (s, [st], [ef], [out]) */
 /* method r:find  (s, [st], [ef]) */
 /* method r:match (s, [st], [ef]) */
+/* method r:test  (s, [st], [ef]) */
+/* method r:search (s, [st], [ef]) */
 static void checkarg_find_method (lua_State *L, TArgExec *argE, TUserdata **ud) {
   *ud = check_ud (L);
   check_subject (L, 2, argE);
@@ -211,6 +327,190 @@ static int algf_new (lua_State *L) {
   return compile_regex (L, &argC, NULL);
 }
 
+/*
+ *  Compiled-pattern cache
+ *  **********************
+ *  String patterns passed to the functions (find, match, gmatch, gsub, count,
+ *  split) are compiled once and then looked up by a key made of the pattern
+ *  bytes, the compilation flags and the library-specific arguments.
+ *  The cache is a table in the function environment:
+ *    cache[CACHE_HEADER] = TCache userdata (LRU list and statistics)
+ *    cache[key]          = TCacheEntry userdata
+ *    cache[entry]        = regex userdata
+ */
+
+#define CACHE_HEADER 1
+
+typedef struct tagCacheEntry {
+  struct tagCacheEntry *prev, *next;   /* neighbours in the LRU list */
+  size_t size;                         /* estimated size of the entry */
+  size_t keylen;                       /* key bytes follow the structure */
+} TCacheEntry;
+
+typedef struct {
+  TCacheEntry *head, *tail;   /* the most and the least recently used entry */
+  int    count;
+  int    capacity;
+  size_t bytes;
+  size_t maxbytes;
+  lua_Number hits, misses, evictions;
+} TCache;
+
+#define CACHE_KEY(e)  ((const char*)((e) + 1))
+
+/* pushes the cache table; returns its header */
+static TCache *cache_push (lua_State *L) {
+  TCache *cache;
+  lua_rawgeti (L, ALG_ENVIRONINDEX, ALG_INDEX_CACHE);
+  lua_rawgeti (L, -1, CACHE_HEADER);
+  cache = (TCache*) lua_touserdata (L, -1);
+  lua_pop (L, 1);
+  return cache;
+}
+
+static void cache_unlink (TCache *cache, TCacheEntry *e) {
+  if (e->prev) e->prev->next = e->next;
+  else         cache->head = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else         cache->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void cache_link (TCache *cache, TCacheEntry *e) {
+  e->prev = NULL;
+  e->next = cache->head;
+  if (cache->head) cache->head->prev = e;
+  else             cache->tail = e;
+  cache->head = e;
+}
+
+/* the cache table must be on Lua stack top */
+static void cache_remove (lua_State *L, TCache *cache, TCacheEntry *e) {
+  cache_unlink (cache, e);
+  --cache->count;
+  cache->bytes -= e->size;
+  lua_pushlstring (L, CACHE_KEY(e), e->keylen);
+  lua_pushvalue (L, -1);
+  lua_rawget (L, -3);                 /* the entry userdata itself */
+  lua_pushnil (L);
+  lua_rawset (L, -4);                 /* cache[entry] = nil */
+  lua_pushnil (L);
+  lua_rawset (L, -3);                 /* cache[key] = nil */
+}
+
+/* the cache table must be on Lua stack top */
+static void cache_shrink (lua_State *L, TCache *cache) {
+  while (cache->tail && (cache->count > cache->capacity ||
+                         cache->bytes > cache->maxbytes)) {
+    cache_remove (L, cache, cache->tail);
+    cache->evictions++;
+  }
+}
+
+static void cache_pushkey (lua_State *L, const TArgComp *argC) {
+  lua_pushlstring (L, (const char*)&argC->cflags, sizeof (argC->cflags));
+  lua_pushlstring (L, (const char*)&argC->patlen, sizeof (argC->patlen));
+  lua_pushlstring (L, argC->pattern, argC->patlen);
+  lua_concat (L, 3 + ALG_CACHE_PUSHLARG (L, argC));
+}
+
+/* Compiles a string pattern or takes it from the cache.
+   The regex userdata is left on the stack top. */
+static void compile_cached (lua_State *L, const TArgComp *argC, TUserdata **pud) {
+  TCache *cache;
+  TCacheEntry *e;
+  TUserdata *ud;
+  int top = lua_gettop (L);
+
+  cache = cache_push (L);                       /* top+1: cache table */
+  if (cache->capacity <= 0) {
+    lua_pop (L, 1);
+    compile_regex (L, argC, pud);
+    return;
+  }
+  cache_pushkey (L, argC);                      /* top+2: key */
+  lua_pushvalue (L, -1);
+  lua_rawget (L, top+1);                        /* top+3: entry or nil */
+  if ((e = (TCacheEntry*) lua_touserdata (L, -1)) != NULL) {
+    ALG_CACHE_FREEARGS (argC);
+    cache->hits++;
+    cache_unlink (cache, e);
+    cache_link (cache, e);
+    lua_rawget (L, top+1);                      /* top+3: regex */
+    ud = (TUserdata*) lua_touserdata (L, -1);
+  }
+  else {
+    size_t keylen;
+    const char *key;
+    lua_pop (L, 1);
+    cache->misses++;
+    compile_regex (L, argC, &ud);               /* top+3: regex */
+    key = lua_tolstring (L, top+2, &keylen);
+    e = (TCacheEntry*) lua_newuserdata (L, sizeof (TCacheEntry) + keylen);
+    e->keylen = keylen;
+    e->size = ALG_CACHE_SIZEOF (ud) + sizeof (TCacheEntry) + keylen;
+    memcpy ((char*)(e + 1), key, keylen);
+    lua_pushvalue (L, top+2);
+    lua_pushvalue (L, -2);
+    lua_rawset (L, top+1);                      /* cache[key] = entry */
+    lua_pushvalue (L, top+3);
+    lua_rawset (L, top+1);                      /* cache[entry] = regex */
+    cache_link (cache, e);
+    ++cache->count;
+    cache->bytes += e->size;
+    lua_pushvalue (L, top+1);
+    cache_shrink (L, cache);
+    lua_pop (L, 1);
+  }
+  lua_replace (L, top+1);
+  lua_settop (L, top+1);
+  if (pud) *pud = ud;
+}
+
+/* function cache_stats () */
+static int algf_cache_stats (lua_State *L) {
+  TCache *cache = cache_push (L);
+  lua_createtable (L, 0, 7);
+  set_int_field (L, "count", cache->count);
+  set_int_field (L, "capacity", cache->capacity);
+  lua_pushnumber (L, (lua_Number)cache->bytes);
+  lua_setfield (L, -2, "bytes");
+  lua_pushnumber (L, (lua_Number)cache->maxbytes);
+  lua_setfield (L, -2, "maxbytes");
+  lua_pushnumber (L, cache->hits);
+  lua_setfield (L, -2, "hits");
+  lua_pushnumber (L, cache->misses);
+  lua_setfield (L, -2, "misses");
+  lua_pushnumber (L, cache->evictions);
+  lua_setfield (L, -2, "evictions");
+  return 1;
+}
+
+/* function cache_clear () */
+static int algf_cache_clear (lua_State *L) {
+  TCache *cache = cache_push (L);
+  while (cache->tail)
+    cache_remove (L, cache, cache->tail);
+  return 0;
+}
+
+/* function cache_config ([capacity], [maxbytes]) */
+static int algf_cache_config (lua_State *L) {
+  TCache *cache;
+  lua_Number maxbytes;
+  int capacity = (int)luaL_optinteger (L, 1, -1);
+  maxbytes = luaL_optnumber (L, 2, -1);
+  cache = cache_push (L);
+  if (capacity >= 0)
+    cache->capacity = capacity;
+  if (maxbytes >= 0)
+    cache->maxbytes = (size_t)maxbytes;
+  cache_shrink (L, cache);
+  lua_pushinteger (L, cache->capacity);
+  lua_pushnumber (L, (lua_Number)cache->maxbytes);
+  return 2;
+}
+
 static void push_substrings (lua_State *L, TUserdata *ud, const char *text,
                              TFreeList *freelist) {
   int i;
@@ -228,7 +528,8 @@ static int algf_gsub (lua_State *L) {
   TUserdata *ud;
   TArgComp argC;
   TArgExec argE;
-  int n_match = 0, n_subst = 0, st = 0, last_to = -1;
+  int n_match = 0, n_subst = 0;
+  size_t st = 0, last_to = ALG_NOPOS;
   TBuffer BufOut, BufRep, BufTemp, *pBuf = &BufOut;
   TFreeList freelist;
   /*------------------------------------------------------------------*/
@@ -237,13 +538,28 @@ static int algf_gsub (lua_State *L) {
     ud = (TUserdata*) argC.ud;
     lua_pushvalue (L, 2);
   }
-  else compile_regex (L, &argC, &ud);
+  else compile_cached (L, &argC, &ud);
+  ALG_PREPARE_SUBJECT (L, ud, &argE, 1);
   freelist_init (&freelist);
   /*------------------------------------------------------------------*/
   if (argE.reptype == LUA_TSTRING) {
     buffer_init (&BufRep, 256, L, &freelist);
     BUFFERZ_PUTREPSTRING (&BufRep, argE.funcpos, ALG_NSUB(ud));
   }
+#ifdef ALG_GSUB_FAST
+  /*------------------------------------------------------------------*/
+  if (argE.reptype == LUA_TSTRING && argE.maxmatch == GSUB_UNLIMITED) {
+    int res = ALG_GSUB_FAST (L, ud, &argE, &BufRep, &n_subst);
+    if (res != 0) {     /* the library made all the substitutions at once */
+      freelist_free (&freelist);
+      if (!ALG_ISMATCH (res))
+        return generate_error (L, ud, res);
+      lua_pushinteger (L, n_subst);
+      lua_pushinteger (L, n_subst);
+      return 3;
+    }
+  }
+#endif
   /*------------------------------------------------------------------*/
   if (argE.maxmatch == GSUB_CONDITIONAL) {
     buffer_init (&BufTemp, 1024, L, &freelist);
@@ -251,9 +567,9 @@ static int algf_gsub (lua_State *L) {
   }
   /*------------------------------------------------------------------*/
   buffer_init (&BufOut, 1024, L, &freelist);
-  while ((argE.maxmatch < 0 || n_match < argE.maxmatch) && st <= (int)argE.textlen) {
-    int from, to, res;
-    int curr_subst = 0;
+  while ((argE.maxmatch < 0 || n_match < argE.maxmatch) && st <= argE.textlen) {
+    size_t from, to;
+    int res, curr_subst = 0;
     res = gsub_exec (ud, &argE, st);
     if (ALG_NOMATCH (res)) {
       break;
@@ -265,9 +581,10 @@ static int algf_gsub (lua_State *L) {
     from = ALG_BASE(st) + ALG_SUBBEG(ud,0);
     to = ALG_BASE(st) + ALG_SUBEND(ud,0);
     if (to == last_to) { /* discard an empty match adjacent to the previous match */
-      if (st < (int)argE.textlen) { /* advance by 1 char (not replaced) */
-        buffer_addlstring (&BufOut, argE.text + st, ALG_CHARSIZE);
-        st += ALG_CHARSIZE;
+      if (st < argE.textlen) { /* advance by 1 char (not replaced) */
+        size_t n = ALG_CHARLEN (ud, argE.text, argE.textlen, st);
+        buffer_addlstring (&BufOut, argE.text + st, n);
+        st += n;
         continue;
       }
       break;
@@ -380,10 +697,11 @@ static int algf_gsub (lua_State *L) {
     if (st < to) {
       st = to;
     }
-    else if (st < (int)argE.textlen) {
+    else if (st < argE.textlen) {
       /* advance by 1 char (not replaced) */
-      buffer_addlstring (&BufOut, argE.text + st, ALG_CHARSIZE);
-      st += ALG_CHARSIZE;
+      size_t n = ALG_CHARLEN (ud, argE.text, argE.textlen, st);
+      buffer_addlstring (&BufOut, argE.text + st, n);
+      st += n;
     }
     else break;
   }
@@ -397,22 +715,14 @@ static int algf_gsub (lua_State *L) {
 }
 
 
-static int algf_count (lua_State *L) {
-  TUserdata *ud;
-  TArgComp argC;
-  TArgExec argE;
-  int n_match = 0, st = 0, last_to = -1;
-  /*------------------------------------------------------------------*/
-  checkarg_count (L, &argC, &argE);
-  if (argC.ud) {
-    ud = (TUserdata*) argC.ud;
-    lua_pushvalue (L, 2);
-  }
-  else compile_regex (L, &argC, &ud);
-  /*------------------------------------------------------------------*/
-  while (st <= (int)argE.textlen) {
-    int to, res;
-    res = gsub_exec (ud, &argE, st);
+/* returns the number of matches in the subject */
+static int count_matches (lua_State *L, TUserdata *ud, TArgExec *argE) {
+  int n_match = 0;
+  size_t st = 0, last_to = ALG_NOPOS;
+  while (st <= argE->textlen) {
+    size_t to;
+    int res;
+    res = gsub_exec (ud, argE, st);
     if (ALG_NOMATCH (res)) {
       break;
     }
@@ -421,8 +731,8 @@ static int algf_count (lua_State *L) {
     }
     to = ALG_BASE(st) + ALG_SUBEND(ud,0);
     if (to == last_to) { /* discard an empty match adjacent to the previous match */
-      if (st < (int)argE.textlen) { /* advance by 1 char */
-        st += ALG_CHARSIZE;
+      if (st < argE->textlen) { /* advance by 1 char */
+        st += ALG_CHARLEN (ud, argE->text, argE->textlen, st);
         continue;
       }
       break;
@@ -431,7 +741,7 @@ static int algf_count (lua_State *L) {
     ++n_match;
 #ifdef ALG_PULL
     {
-      int from = ALG_BASE(st) + ALG_SUBBEG(ud,0);
+      size_t from = ALG_BASE(st) + ALG_SUBBEG(ud,0);
       if (st < from)
         st = from;
     }
@@ -440,21 +750,281 @@ static int algf_count (lua_State *L) {
     if (st < to) {
       st = to;
     }
-    else if (st < (int)argE.textlen) {
+    else if (st < argE->textlen) {
       /* advance by 1 char (not replaced) */
-      st += ALG_CHARSIZE;
+      st += ALG_CHARLEN (ud, argE->text, argE->textlen, st);
     }
     else break;
   }
+  return n_match;
+}
+
+
+static int algf_count (lua_State *L) {
+  TUserdata *ud;
+  TArgComp argC;
+  TArgExec argE;
   /*------------------------------------------------------------------*/
-  lua_pushinteger (L, n_match);
+  checkarg_count (L, &argC, &argE);
+  if (argC.ud) {
+    ud = (TUserdata*) argC.ud;
+    lua_pushvalue (L, 2);
+  }
+  else compile_cached (L, &argC, &ud);
+  ALG_PREPARE_SUBJECT (L, ud, &argE, 1);
+  /*------------------------------------------------------------------*/
+  lua_pushinteger (L, count_matches (L, ud, &argE));
+  return 1;
+}
+
+
+#ifdef ALG_NAMES
+/*
+ *  Named subpatterns
+ *  *****************
+ *  The names of a regex are resolved once, by compile_regex, into a table
+ *  {name1, n1, name2, n2, ...} of the names and their group numbers, where the
+ *  entries of a name used by several groups are adjacent. Its hash part maps
+ *  each name to the index of its first entry.
+ */
+
+/* adds to the names table on the stack top an entry for group n */
+static void names_add (lua_State *L, const char *name, size_t len, int n) {
+  int k = (int) lua_objlen (L, -1);
+  lua_pushlstring (L, name, len);
+  lua_pushvalue (L, -1);
+  lua_rawget (L, -3);
+  if (lua_isnil (L, -1)) {
+    lua_pushvalue (L, -2);
+    lua_pushinteger (L, k + 1);
+    lua_rawset (L, -5);
+  }
+  lua_pop (L, 1);
+  lua_rawseti (L, -2, k + 1);
+  lua_pushinteger (L, n);
+  lua_rawseti (L, -2, k + 2);
+}
+
+
+/* pops the names table, returning its registry reference (0: no names) */
+static int names_ref (lua_State *L) {
+  if (lua_objlen (L, -1) == 0) {
+    lua_pop (L, 1);
+    return 0;
+  }
+  return luaL_ref (L, LUA_REGISTRYINDEX);
+}
+
+
+/* Of the groups named as the entry at index i of the names table on the stack
+   top, returns the last one that participated in the match, or the first one
+   if none did. offsets is that of a match object, or NULL for the last match
+   of ud. *next receives the index of the entry of the next name. */
+static int names_group (lua_State *L, TUserdata *ud, const size_t *offsets,
+                        int i, int *next) {
+  int n = (int) lua_objlen (L, -1), first = -1, found = -1;
+  lua_rawgeti (L, -1, i);
+  for (; i < n; i += 2) {
+    int g, valid;
+    lua_rawgeti (L, -2, i);
+    if (!lua_rawequal (L, -1, -2)) {
+      lua_pop (L, 1);
+      break;
+    }
+    lua_rawgeti (L, -3, i + 1);
+    g = (int) lua_tointeger (L, -1);
+    lua_pop (L, 2);
+    valid = offsets ? offsets[g+g] != ALG_NOPOS : ALG_SUBVALID (ud,g);
+    if (first < 0)
+      first = g;
+    if (valid)
+      found = g;
+  }
+  lua_pop (L, 1);
+  if (next)
+    *next = i;
+  return found >= 0 ? found : first;
+}
+
+
+/* sets the named captures in the table on the stack top */
+static void do_named_subpatterns (lua_State *L, TUserdata *ud, const char *text) {
+  int i, n, next;
+  if (ALG_NAMES(ud) == 0)
+    return;
+  lua_rawgeti (L, LUA_REGISTRYINDEX, ALG_NAMES(ud));
+  n = (int) lua_objlen (L, -1);
+  for (i = 1; i < n; i = next) {
+    int g = names_group (L, ud, NULL, i, &next);
+    lua_rawgeti (L, -1, i);
+    ALG_PUSHSUB_OR_FALSE (L, ud, text, g);
+    lua_rawset (L, -4);
+  }
+  lua_pop (L, 1);
+}
+#endif
+
+
+/*
+ *  Match objects
+ *  *************
+ *  A match object keeps the offsets of a match and its captures, and makes
+ *  the capture strings only when they are asked for. Its user value is the
+ *  table {subject, regex}.
+ */
+
+typedef struct {
+  int nsub;
+  size_t *offsets;     /* start and end of the match, then of each capture
+                          (ALG_NOPOS if it did not participate); they follow
+                          the struct in the userdata block */
+} TMatchObj;
+
+
+static void push_match_object (lua_State *L, TUserdata *ud, TArgExec *argE,
+                               int subjpos, int regpos) {
+  int i;
+  size_t base = ALG_BASE(argE->startoffset);
+  TMatchObj *m = (TMatchObj*) lua_newuserdata (L,
+    sizeof (TMatchObj) + 2 * (ALG_NSUB(ud) + 1) * sizeof (size_t));
+  (void)argE;                              /* unused where ALG_BASE is 0 */
+  m->nsub = ALG_NSUB(ud);
+  m->offsets = (size_t*)(m + 1);
+  for (i = 0; i <= m->nsub; i++) {
+    if (i == 0 || ALG_SUBVALID (ud,i)) {
+      m->offsets[i+i] = base + ALG_SUBBEG(ud,i);
+      m->offsets[i+i+1] = base + ALG_SUBEND(ud,i);
+    }
+    else
+      m->offsets[i+i] = m->offsets[i+i+1] = ALG_NOPOS;
+  }
+  lua_rawgeti (L, ALG_ENVIRONINDEX, ALG_INDEX_MATCH_META);
+  lua_setmetatable (L, -2);
+  lua_createtable (L, 2, 0);
+  lua_pushvalue (L, subjpos);
+  lua_rawseti (L, -2, 1);
+  lua_pushvalue (L, regpos);
+  lua_rawseti (L, -2, 2);
+  alg_setuservalue (L, -2);
+}
+
+
+static TMatchObj *check_match_object (lua_State *L) {
+  TMatchObj *m = (TMatchObj*) lua_touserdata (L, 1);
+  if (m == NULL || !lua_getmetatable (L, 1))
+    luaL_typerror (L, 1, "match object");
+  lua_rawgeti (L, ALG_ENVIRONINDEX, ALG_INDEX_MATCH_META);
+  if (!lua_rawequal (L, -1, -2))
+    luaL_typerror (L, 1, "match object");
+  lua_pop (L, 2);
+  return m;
+}
+
+
+/* the capture given by number or name at pos, or -1 if there is none */
+static int match_object_group (lua_State *L, TMatchObj *m, int pos) {
+  int i = -1;
+  if (lua_type (L, pos) == LUA_TNUMBER) {
+    i = (int) lua_tointeger (L, pos);
+  }
+#ifdef ALG_NAMES
+  else if (lua_type (L, pos) == LUA_TSTRING) {
+    TUserdata *ud;
+    alg_getuservalue (L, 1);
+    lua_rawgeti (L, -1, 2);
+    ud = (TUserdata*) lua_touserdata (L, -1);
+    lua_pop (L, 2);
+    if (ALG_NAMES(ud) == 0)
+      return -1;
+    lua_rawgeti (L, LUA_REGISTRYINDEX, ALG_NAMES(ud));
+    lua_pushvalue (L, pos);
+    lua_rawget (L, -2);
+    if (lua_isnumber (L, -1)) {
+      int k = (int) lua_tointeger (L, -1);
+      lua_pop (L, 1);
+      i = names_group (L, ud, m->offsets, k, NULL);
+    }
+    else
+      lua_pop (L, 1);
+    lua_pop (L, 1);
+  }
+#endif
+  return (i >= 0 && i <= m->nsub) ? i : -1;
+}
+
+
+/* m[i], m[name]: the capture (the whole match if i == 0), or false if it did
+   not participate; methods take precedence over the names */
+static int match_object_index (lua_State *L) {
+  TMatchObj *m = check_match_object (L);
+  int i;
+  if (lua_type (L, 2) == LUA_TSTRING) {
+    lua_rawgeti (L, ALG_ENVIRONINDEX, ALG_INDEX_MATCH_META);
+    lua_pushvalue (L, 2);
+    lua_rawget (L, -2);
+    if (!lua_isnil (L, -1))
+      return 1;
+    lua_pop (L, 2);
+  }
+  if ((i = match_object_group (L, m, 2)) < 0)
+    return lua_pushnil (L), 1;
+  if (m->offsets[i+i] == ALG_NOPOS)
+    return lua_pushboolean (L, 0), 1;
+  else {
+    TArgExec argE;
+    alg_getuservalue (L, 1);
+    lua_rawgeti (L, -1, 1);
+    check_subject (L, lua_gettop (L), &argE);
+    if (m->offsets[i+i+1] > argE.textlen)   /* a buffer may have shrunk */
+      return luaL_error (L, "subject is shorter than the match");
+    lua_pushlstring (L, argE.text + m->offsets[i+i],
+                     m->offsets[i+i+1] - m->offsets[i+i]);
+    return 1;
+  }
+}
+
+
+/* m:span ([i]): the start and end points of a capture, made of no strings */
+static int match_object_span (lua_State *L) {
+  TMatchObj *m = check_match_object (L);
+  int i = lua_isnoneornil (L, 2) ? 0 : match_object_group (L, m, 2);
+  if (i < 0)
+    return lua_pushnil (L), 1;
+  if (m->offsets[i+i] == ALG_NOPOS) {
+    lua_pushboolean (L, 0);
+    lua_pushboolean (L, 0);
+  }
+  else {
+    lua_pushinteger (L, (lua_Integer) (m->offsets[i+i] / ALG_CHARSIZE + 1));
+    lua_pushinteger (L, (lua_Integer) (m->offsets[i+i+1] / ALG_CHARSIZE));
+  }
+  return 2;
+}
+
+
+static int match_object_len (lua_State *L) {
+  lua_pushinteger (L, check_match_object (L)->nsub);
   return 1;
 }
 
 
+static const luaL_Reg match_object_meta[] = {
+  { "__index", match_object_index },
+  { "__len",   match_object_len },
+  { "span",    match_object_span },
+  { NULL, NULL }
+};
+
+
 static int finish_generic_find (lua_State *L, TUserdata *ud, TArgExec *argE,
   int method, int res)
 {
+  if (method == METHOD_TEST) {
+    if (!ALG_ISMATCH (res) && !ALG_NOMATCH (res))
+      return generate_error (L, ud, res);
+    lua_pushboolean (L, ALG_ISMATCH (res));
+    return 1;
+  }
   if (ALG_ISMATCH (res)) {
     if (method == METHOD_FIND)
       ALG_PUSHOFFSETS (L, ud, ALG_BASE(argE->startoffset), 0);
@@ -477,18 +1047,25 @@ static int generic_find_func (lua_State *L, int method) {
   TUserdata *ud;
   TArgComp argC;
   TArgExec argE;
-  int res;
+  int res, regpos;
 
   checkarg_find_func (L, &argC, &argE);
-  if (argE.startoffset > (int)argE.textlen)
-    return lua_pushnil (L), 1;
+  if (argE.startoffset > argE.textlen)
+    return (method == METHOD_TEST) ? lua_pushboolean (L, 0) : lua_pushnil (L), 1;
 
   if (argC.ud) {
     ud = (TUserdata*) argC.ud;
     lua_pushvalue (L, 2);
   }
-  else compile_regex (L, &argC, &ud);
-  res = findmatch_exec (ud, &argE);
+  else compile_cached (L, &argC, &ud);
+  regpos = lua_gettop (L);
+  ALG_PREPARE_SUBJECT (L, ud, &argE, 1);
+  if (method == METHOD_TEST)
+    res = ALG_TEST_EXEC (ud, &argE);
+  else
+    res = findmatch_exec (ud, &argE);
+  if (method == METHOD_SEARCH && ALG_ISMATCH (res))
+    return push_match_object (L, ud, &argE, 1, regpos), 1;
   return finish_generic_find (L, ud, &argE, method, res);
 }
 
@@ -503,32 +1080,45 @@ static int algf_match (lua_State *L) {
 }
 
 
+static int algf_test (lua_State *L) {
+  return generic_find_func (L, METHOD_TEST);
+}
+
+
+static int algf_search (lua_State *L) {
+  return generic_find_func (L, METHOD_SEARCH);
+}
+
+
 static int gmatch_iter (lua_State *L) {
-  int last_end, res;
+  int res;
+  size_t last_end;
   TArgExec argE;
   TUserdata *ud    = (TUserdata*) lua_touserdata (L, lua_upvalueindex (1));
-  argE.text        = lua_tolstring (L, lua_upvalueindex (2), &argE.textlen);
-  argE.eflags      = lua_tointeger (L, lua_upvalueindex (3));
-  argE.startoffset = lua_tointeger (L, lua_upvalueindex (4));
-  last_end         = lua_tointeger (L, lua_upvalueindex (5));
+  check_subject (L, lua_upvalueindex (2), &argE); /* re-fetch: buffers may move */
+  argE.eflags      = (int) lua_tointeger (L, lua_upvalueindex (3));
+  argE.startoffset = (size_t) lua_tointeger (L, lua_upvalueindex (4));
+  last_end         = (size_t) lua_tointeger (L, lua_upvalueindex (5));
 
   while (1) {
-    if (argE.startoffset > (int)argE.textlen)
+    if (argE.startoffset > argE.textlen)
       return 0;
     res = gmatch_exec (ud, &argE);
     if (ALG_ISMATCH (res)) {
       int incr = 0;
       if (!ALG_SUBLEN(ud,0)) { /* no progress: prevent endless loop */
         if (last_end == ALG_BASE(argE.startoffset) + ALG_SUBEND(ud,0)) {
-          argE.startoffset += ALG_CHARSIZE;
+          argE.startoffset += ALG_CHARLEN (ud, argE.text, argE.textlen,
+                                           argE.startoffset);
           continue;
         }
-        incr = ALG_CHARSIZE;
+        incr = (int) ALG_CHARLEN (ud, argE.text, argE.textlen,
+                 ALG_BASE(argE.startoffset) + ALG_SUBEND(ud,0));
       }
       last_end = ALG_BASE(argE.startoffset) + ALG_SUBEND(ud,0);
-      lua_pushinteger(L, last_end + incr); /* update start offset */
+      lua_pushinteger(L, (lua_Integer)(last_end + incr)); /* update start offset */
       lua_replace (L, lua_upvalueindex (4));
-      lua_pushinteger(L, last_end); /* update last end of match */
+      lua_pushinteger(L, (lua_Integer)last_end); /* update last end of match */
       lua_replace (L, lua_upvalueindex (5));
       /* push either captures or entire match */
       if (ALG_NSUB(ud)) {
@@ -548,35 +1138,93 @@ static int gmatch_iter (lua_State *L) {
 }
 
 
+/* Does the whole scan of gmatch at once, and pushes a flat array of the match
+   offsets {s1,e1,s2,e2,...}, each pair followed by those of the captures if
+   caps is set (false for a capture that did not participate), and the number
+   of the matches. */
+static int find_all (lua_State *L, TUserdata *ud, TArgExec *argE, int caps) {
+  const char *text = argE->text;
+  size_t textlen = argE->textlen;
+  int eflags = argE->eflags;
+  size_t st = 0, last_end = ALG_NOPOS;
+  int n = 0, k = 0;
+  int ncapt = caps ? ALG_NSUB(ud) : 0;
+
+  lua_newtable (L);
+  while (n != argE->maxmatch && st <= textlen) {
+    int res, i;
+    size_t base;
+    argE->text = text;          /* gmatch_exec may have advanced these */
+    argE->textlen = textlen;
+    argE->eflags = eflags;
+    argE->startoffset = st;
+    res = gmatch_exec (ud, argE);
+    if (ALG_NOMATCH (res))
+      break;
+    else if (!ALG_ISMATCH (res))
+      return generate_error (L, ud, res);
+    base = ALG_BASE(st);
+    if (!ALG_SUBLEN(ud,0) && last_end == base + ALG_SUBEND(ud,0)) {
+      /* an empty match adjacent to the previous match */
+      st += ALG_CHARLEN (ud, text, textlen, st);
+      continue;
+    }
+    for (i = 0; i <= ncapt; i++) {
+      if (i == 0 || ALG_SUBVALID (ud,i)) {
+        ALG_PUSHSTART (L, ud, base, i);
+        lua_rawseti (L, -2, ++k);
+        ALG_PUSHEND (L, ud, base, i);
+        lua_rawseti (L, -2, ++k);
+      }
+      else {
+        lua_pushboolean (L, 0);
+        lua_rawseti (L, -2, ++k);
+        lua_pushboolean (L, 0);
+        lua_rawseti (L, -2, ++k);
+      }
+    }
+    ++n;
+    last_end = base + ALG_SUBEND(ud,0);
+    st = ALG_SUBLEN(ud,0) ? last_end :
+      last_end + ALG_CHARLEN (ud, text, textlen, last_end);
+  }
+  lua_pushinteger (L, n);
+  return 2;
+}
+
+
 static int split_iter (lua_State *L) {
-  int incr, last_end, newoffset, res;
+  int incr, res;
+  size_t last_end, newoffset;
   TArgExec argE;
   TUserdata *ud    = (TUserdata*) lua_touserdata (L, lua_upvalueindex (1));
-  argE.text        = lua_tolstring (L, lua_upvalueindex (2), &argE.textlen);
-  argE.eflags      = lua_tointeger (L, lua_upvalueindex (3));
-  argE.startoffset = lua_tointeger (L, lua_upvalueindex (4));
-  incr             = lua_tointeger (L, lua_upvalueindex (5));
-  last_end         = lua_tointeger (L, lua_upvalueindex (6));
+  check_subject (L, lua_upvalueindex (2), &argE); /* re-fetch: buffers may move */
+  argE.eflags      = (int) lua_tointeger (L, lua_upvalueindex (3));
+  argE.startoffset = (size_t) lua_tointeger (L, lua_upvalueindex (4));
+  incr             = (int) lua_tointeger (L, lua_upvalueindex (5));
+  last_end         = (size_t) lua_tointeger (L, lua_upvalueindex (6));
 
   if (incr < 0)
     return 0;
 
   while (1) {
-    if ((newoffset = argE.startoffset + incr) > (int)argE.textlen)
+    if ((newoffset = argE.startoffset + incr) > argE.textlen)
       break;
     res = split_exec (ud, &argE, newoffset);
     if (ALG_ISMATCH (res)) {
       if (!ALG_SUBLEN(ud,0)) { /* no progress: prevent endless loop */
         if (last_end == ALG_BASE(argE.startoffset) + ALG_SUBEND(ud,0)) {
-          incr += ALG_CHARSIZE;
+          incr += (int) ALG_CHARLEN (ud, argE.text, argE.textlen, newoffset);
           continue;
         }
       }
-      lua_pushinteger(L, ALG_BASE(newoffset) + ALG_SUBEND(ud,0)); /* update start offset and last_end */
+      lua_pushinteger(L, (lua_Integer)(ALG_BASE(newoffset) + ALG_SUBEND(ud,0))); /* update start offset and last_end */
       lua_pushvalue (L, -1);
       lua_replace (L, lua_upvalueindex (4));
       lua_replace (L, lua_upvalueindex (6));
-      lua_pushinteger (L, ALG_SUBLEN(ud,0) ? 0 : ALG_CHARSIZE);    /* update incr */
+      incr = ALG_SUBLEN(ud,0) ? 0 : (int) ALG_CHARLEN (ud, argE.text,
+               argE.textlen, ALG_BASE(newoffset) + ALG_SUBEND(ud,0));
+      lua_pushinteger (L, incr);    /* update incr */
       lua_replace (L, lua_upvalueindex (5));
       /* push text preceding the match */
       lua_pushlstring (L, argE.text + argE.startoffset,
@@ -605,32 +1253,64 @@ static int split_iter (lua_State *L) {
 
 static int algf_gmatch (lua_State *L)
 {
+  TUserdata *ud;
   TArgComp argC;
   TArgExec argE;
+  int eflags;
   checkarg_gmatch_split (L, &argC, &argE);
-  if (argC.ud)
+  if (argC.ud) {
+    ud = (TUserdata*) argC.ud;
     lua_pushvalue (L, 2);
+  }
   else
-    compile_regex (L, &argC, NULL);           /* 1-st upvalue: ud */
-  gmatch_pushsubject (L, &argE);              /* 2-nd upvalue: s  */
-  lua_pushinteger (L, argE.eflags);           /* 3-rd upvalue: ef */
+    compile_cached (L, &argC, &ud);           /* 1-st upvalue: ud */
+  eflags = argE.eflags;
+  ALG_PREPARE_SUBJECT (L, ud, &argE, 1);
+  if (lua_type (L, 1) == LUA_TSTRING)   /* a buffer may change between calls */
+    eflags = argE.eflags;
+  gmatch_pushsubject (L, &argE, 1);           /* 2-nd upvalue: s  */
+  lua_pushinteger (L, eflags);                /* 3-rd upvalue: ef */
   lua_pushinteger (L, 0);                     /* 4-th upvalue: startoffset */
   lua_pushinteger (L, -1);                    /* 5-th upvalue: last end of match */
   lua_pushcclosure (L, gmatch_iter, 5);
   return 1;
 }
 
+static int algf_find_all (lua_State *L)
+{
+  TUserdata *ud;
+  TArgComp argC;
+  TArgExec argE;
+  checkarg_find_all (L, &argC, &argE);
+  if (argC.ud) {
+    ud = (TUserdata*) argC.ud;
+    lua_pushvalue (L, 2);
+  }
+  else
+    compile_cached (L, &argC, &ud);
+  ALG_PREPARE_SUBJECT (L, ud, &argE, 1);
+  return find_all (L, ud, &argE, lua_toboolean (L, 6));
+}
+
 static int algf_split (lua_State *L)
 {
+  TUserdata *ud;
   TArgComp argC;
   TArgExec argE;
+  int eflags;
   checkarg_gmatch_split (L, &argC, &argE);
-  if (argC.ud)
+  if (argC.ud) {
+    ud = (TUserdata*) argC.ud;
     lua_pushvalue (L, 2);
+  }
   else
-    compile_regex (L, &argC, NULL);           /* 1-st upvalue: ud */
-  gmatch_pushsubject (L, &argE);              /* 2-nd upvalue: s  */
-  lua_pushinteger (L, argE.eflags);           /* 3-rd upvalue: ef */
+    compile_cached (L, &argC, &ud);           /* 1-st upvalue: ud */
+  eflags = argE.eflags;
+  ALG_PREPARE_SUBJECT (L, ud, &argE, 1);
+  if (lua_type (L, 1) == LUA_TSTRING)   /* a buffer may change between calls */
+    eflags = argE.eflags;
+  gmatch_pushsubject (L, &argE, 1);           /* 2-nd upvalue: s  */
+  lua_pushinteger (L, eflags);                /* 3-rd upvalue: ef */
   lua_pushinteger (L, 0);                     /* 4-th upvalue: startoffset */
   lua_pushinteger (L, 0);                     /* 5-th upvalue: incr */
   lua_pushinteger (L, -1);                    /* 6-th upvalue: last_end */
@@ -639,9 +1319,10 @@ static int algf_split (lua_State *L)
 }
 
 
-static void push_substring_table (lua_State *L, TUserdata *ud, const char *text) {
+static void push_substring_table (lua_State *L, TUserdata *ud, const char *text,
+                                  int outpos) {
   int i;
-  lua_newtable (L);
+  push_result_table (L, outpos, ALG_NSUB(ud));
   for (i = 1; i <= ALG_NSUB(ud); i++) {
     ALG_PUSHSUB_OR_FALSE (L, ud, text, i);
     lua_rawseti (L, -2, i);
@@ -649,9 +1330,10 @@ static void push_substring_table (lua_State *L, TUserdata *ud, const char *text)
 }
 
 
-static void push_offset_table (lua_State *L, TUserdata *ud, int startoffset) {
+static void push_offset_table (lua_State *L, TUserdata *ud, size_t startoffset,
+                               int outpos) {
   int i, j;
-  lua_newtable (L);
+  push_result_table (L, outpos, 2 * ALG_NSUB(ud));
   for (i=1, j=1; i <= ALG_NSUB(ud); i++) {
     if (ALG_SUBVALID (ud,i)) {
       ALG_PUSHSTART (L, ud, startoffset, i);
@@ -672,25 +1354,33 @@ static void push_offset_table (lua_State *L, TUserdata *ud, int startoffset) {
 static int generic_find_method (lua_State *L, int method) {
   TUserdata *ud;
   TArgExec argE;
-  int res;
+  int res, outpos;
 
   checkarg_find_method (L, &argE, &ud);
-  if (argE.startoffset > (int)argE.textlen)
-    return lua_pushnil(L), 1;
-
+  outpos = (method == METHOD_EXEC || method == METHOD_TFIND) ?
+    OptResultTable (L, 5) : 0;
+  if (argE.startoffset > argE.textlen)
+    return (method == METHOD_TEST) ? lua_pushboolean (L, 0) : lua_pushnil (L), 1;
+
+  ALG_PREPARE_SUBJECT (L, ud, &argE, 2);
+  if (method == METHOD_TEST)
+    return finish_generic_find (L, ud, &argE, method, ALG_TEST_EXEC (ud, &argE));
   res = findmatch_exec (ud, &argE);
   if (ALG_ISMATCH (res)) {
     switch (method) {
       case METHOD_EXEC:
         ALG_PUSHOFFSETS (L, ud, ALG_BASE(argE.startoffset), 0);
-        push_offset_table (L, ud, ALG_BASE(argE.startoffset));
+        push_offset_table (L, ud, ALG_BASE(argE.startoffset), outpos);
         DO_NAMED_SUBPATTERNS (L, ud, argE.text);
         return 3;
       case METHOD_TFIND:
         ALG_PUSHOFFSETS (L, ud, ALG_BASE(argE.startoffset), 0);
-        push_substring_table (L, ud, argE.text);
+        push_substring_table (L, ud, argE.text, outpos);
         DO_NAMED_SUBPATTERNS (L, ud, argE.text);
         return 3;
+      case METHOD_SEARCH:
+        push_match_object (L, ud, &argE, 2, 1);
+        return 1;
       case METHOD_MATCH:
       case METHOD_FIND:
         return finish_generic_find (L, ud, &argE, method, res);
@@ -716,6 +1406,193 @@ static int algm_tfind (lua_State *L) {
 static int algm_exec (lua_State *L) {
   return generic_find_method (L, METHOD_EXEC);
 }
+static int algm_test (lua_State *L) {
+  return generic_find_method (L, METHOD_TEST);
+}
+static int algm_search (lua_State *L) {
+  return generic_find_method (L, METHOD_SEARCH);
+}
+
+
+/* method r:find_all (s, [ef], [max], [caps]) */
+static int algm_find_all (lua_State *L) {
+  TUserdata *ud;
+  TArgExec argE;
+  ud = check_ud (L);
+  check_subject (L, 2, &argE);
+  argE.eflags = (int)luaL_optinteger (L, 3, ALG_EFLAGS_DFLT);
+  argE.maxmatch = (int)luaL_optinteger (L, 4, GSUB_UNLIMITED);
+  ALG_PREPARE_SUBJECT (L, ud, &argE, 2);
+  return find_all (L, ud, &argE, lua_toboolean (L, 5));
+}
+
+
+/*
+ *  Grep
+ *  ****
+ *  Each line is matched as a subject of its own, so that ^ and $ match at its
+ *  ends and no match goes on past it. The lines are found with memchr, which
+ *  the C library vectorises.
+ */
+
+/* tells if the line text[st..eol) holds a match */
+static int grep_line (lua_State *L, TUserdata *ud, const TArgExec *argE,
+                      size_t st, size_t eol) {
+  TArgExec lineE = *argE;       /* the exec functions may change it */
+  int res;
+  lineE.text = argE->text + st;
+  lineE.textlen = eol - st;
+  lineE.startoffset = 0;
+  res = ALG_TEST_EXEC (ud, &lineE);
+  if (ALG_ISMATCH (res))
+    return 1;
+  if (!ALG_NOMATCH (res))
+    generate_error (L, ud, res);
+  return 0;
+}
+
+/* method r:grep (s, [opts], [max], [ef]) */
+static int algm_grep (lua_State *L) {
+  TUserdata *ud;
+  TArgExec argE;
+  const char *opts;
+  int count = 0, invert = 0, spans = 0, max, n = 0;
+  size_t st = 0;
+  lua_Integer lineno = 1;
+
+  ud = check_ud (L);
+  check_subject (L, 2, &argE);
+  for (opts = luaL_optstring (L, 3, ""); *opts; opts++) {
+    switch (*opts) {
+      case 'c': count = 1;  break;
+      case 'v': invert = 1; break;
+      case 's': spans = 1;  break;
+      default:  return luaL_argerror (L, 3, "unknown option");
+    }
+  }
+  max = (int)luaL_optinteger (L, 4, GSUB_UNLIMITED);
+  argE.eflags = (int)luaL_optinteger (L, 5, ALG_EFLAGS_DFLT);
+  argE.startoffset = 0;
+  ALG_PREPARE_SUBJECT (L, ud, &argE, 2);
+  lua_settop (L, 5);
+  if (!count) {
+    lua_newtable (L);                              /* line numbers (6) */
+    if (spans) {
+      lua_newtable (L);                            /* start points (7) */
+      lua_newtable (L);                            /* end points (8) */
+    }
+  }
+
+  while (st < argE.textlen && n != max) {
+    const char *nl = (const char*) memchr (argE.text + st, '\n', argE.textlen - st);
+    size_t eol = nl ? (size_t)(nl - argE.text) : argE.textlen;
+    if (grep_line (L, ud, &argE, st, eol) != invert) {
+      ++n;
+      if (!count) {
+        lua_pushinteger (L, lineno);
+        lua_rawseti (L, 6, n);
+        if (spans) {
+          lua_pushinteger (L, (lua_Integer)st + 1);
+          lua_rawseti (L, 7, n);
+          lua_pushinteger (L, (lua_Integer)eol);
+          lua_rawseti (L, 8, n);
+        }
+      }
+    }
+    st = eol + 1;
+    ++lineno;
+  }
+
+  if (count) {
+    lua_pushinteger (L, n);
+    return 1;
+  }
+  return spans ? 3 : 1;
+}
+
+
+/*
+ *  Batch methods
+ *  *************
+ *  The subjects are taken from an array; the results are written into arrays
+ *  preallocated for the whole batch.
+ */
+
+#define BATCH_TEST  0
+#define BATCH_EXEC  1
+#define BATCH_COUNT 2
+
+/* method r:test_batch  (subjects, [ef]) */
+/* method r:exec_batch  (subjects, [ef]) */
+/* method r:count_batch (subjects, [ef]) */
+static int generic_batch_method (lua_State *L, int method) {
+  TUserdata *ud;
+  TArgExec argE;
+  int eflags, n, i, subjpos;
+
+  ud = check_ud (L);
+  luaL_checktype (L, 2, LUA_TTABLE);
+  eflags = (int)luaL_optinteger (L, 3, ALG_EFLAGS_DFLT);
+  lua_settop (L, 3);
+  n = (int)lua_objlen (L, 2);
+  lua_createtable (L, n, 0);                          /* results (4) */
+  if (method == BATCH_EXEC)
+    lua_createtable (L, n, 0);                        /* end offsets (5) */
+  subjpos = lua_gettop (L) + 1;
+
+  for (i = 1; i <= n; i++) {
+    int res;
+    lua_rawgeti (L, 2, i);
+    check_subject (L, subjpos, &argE);
+    argE.startoffset = 0;
+    argE.eflags = eflags;
+    ALG_PREPARE_SUBJECT (L, ud, &argE, subjpos);
+    if (method == BATCH_COUNT) {
+      lua_pushinteger (L, count_matches (L, ud, &argE));
+      lua_rawseti (L, 4, i);
+      lua_pop (L, 1);
+      continue;
+    }
+    if (method == BATCH_TEST)
+      res = ALG_TEST_EXEC (ud, &argE);
+    else
+      res = findmatch_exec (ud, &argE);
+    if (ALG_ISMATCH (res)) {
+      if (method == BATCH_EXEC) {
+        ALG_PUSHSTART (L, ud, ALG_BASE(argE.startoffset), 0);
+        lua_rawseti (L, 4, i);
+        ALG_PUSHEND (L, ud, ALG_BASE(argE.startoffset), 0);
+        lua_rawseti (L, 5, i);
+      }
+      else {
+        lua_pushboolean (L, 1);
+        lua_rawseti (L, 4, i);
+      }
+    }
+    else if (ALG_NOMATCH (res)) {
+      lua_pushboolean (L, 0);
+      lua_rawseti (L, 4, i);
+      if (method == BATCH_EXEC) {
+        lua_pushboolean (L, 0);
+        lua_rawseti (L, 5, i);
+      }
+    }
+    else
+      return generate_error (L, ud, res);
+    lua_pop (L, 1);
+  }
+  return (method == BATCH_EXEC) ? 2 : 1;
+}
+
+static int algm_test_batch (lua_State *L) {
+  return generic_batch_method (L, BATCH_TEST);
+}
+static int algm_exec_batch (lua_State *L) {
+  return generic_batch_method (L, BATCH_EXEC);
+}
+static int algm_count_batch (lua_State *L) {
+  return generic_batch_method (L, BATCH_COUNT);
+}
 
 static void alg_register (lua_State *L, const luaL_Reg *r_methods,
                           const luaL_Reg *r_functions, const char *name) {
@@ -733,6 +1610,30 @@ static void alg_register (lua_State *L, const luaL_Reg *r_methods,
   lua_pushvalue(L, -1); /* mt.__index = mt */
   lua_setfield(L, -2, "__index");
 
+  /* Create the metatable of match objects. */
+  lua_newtable (L);
+  lua_pushliteral (L, "access denied");
+  lua_setfield (L, -2, "__metatable");
+#if LUA_VERSION_NUM == 501
+  luaL_register (L, NULL, match_object_meta);
+#else
+  lua_pushvalue (L, -2);
+  luaL_setfuncs (L, match_object_meta, 1);
+#endif
+  lua_rawseti (L, -2, ALG_INDEX_MATCH_META);
+
+  /* Create the compiled-pattern cache. */
+  {
+    TCache *cache;
+    lua_newtable (L);
+    cache = (TCache*) lua_newuserdata (L, sizeof (TCache));
+    memset (cache, 0, sizeof (TCache));
+    cache->capacity = REX_CACHE_CAPACITY;
+    cache->maxbytes = REX_CACHE_MAXBYTES;
+    lua_rawseti (L, -2, CACHE_HEADER);
+    lua_rawseti (L, -2, ALG_INDEX_CACHE);
+  }
+
   /* Register functions. */
   lua_createtable(L, 0, 8);
 #if LUA_VERSION_NUM == 501
@@ -747,6 +1648,8 @@ static void alg_register (lua_State *L, const luaL_Reg *r_methods,
 #endif
   lua_pushfstring (L, REX_VERSION" (for %s)", name);
   lua_setfield (L, -2, "_VERSION");
+  lua_pushcfunction (L, rex_mmap);
+  lua_setfield (L, -2, "mmap");
 #ifndef REX_NOEMBEDDEDTEST
   lua_pushcfunction (L, newmembuffer);
   lua_setfield (L, -2, "_newmembuffer");
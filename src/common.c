@@ -4,6 +4,14 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <errno.h>
+#include <locale.h>
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
 #include "lua.h"
 #include "lauxlib.h"
 #include "common.h"
@@ -27,6 +35,92 @@ void set_int_field (lua_State *L, const char* field, int val)
   lua_setfield (L, -2, field);
 }
 
+static unsigned long get_limit_field (lua_State *L, int pos, const char *field,
+                                      unsigned long dflt) {
+  lua_Number val;
+  lua_getfield (L, pos, field);
+  if (lua_isnil (L, -1))
+    val = (lua_Number) dflt;
+  else {
+    val = lua_tonumber (L, -1);
+    if (!lua_isnumber (L, -1) || val < 0 || val > 4294967295.0)
+      luaL_error (L, "bad value of the limit '%s'", field);
+  }
+  lua_pop (L, 1);
+  return (unsigned long) val;
+}
+
+/* reads the optional table of match limits at pos;
+   the absent fields keep their values in lim */
+void get_match_limits (lua_State *L, int pos, TMatchLimits *lim)
+{
+  if (lua_isnoneornil (L, pos))
+    return;
+  luaL_checktype (L, pos, LUA_TTABLE);
+  lim->match = get_limit_field (L, pos, "match_limit", lim->match);
+  lim->depth = get_limit_field (L, pos, "depth_limit", lim->depth);
+  lim->heap  = get_limit_field (L, pos, "heap_limit",  lim->heap);
+}
+
+/* updates the default limits lim from the table at pos, all at once */
+void set_default_limits (lua_State *L, int pos, TMatchLimits *lim)
+{
+  TMatchLimits newlim = *lim;
+  luaL_checktype (L, pos, LUA_TTABLE);
+  get_match_limits (L, pos, &newlim);   /* may raise an error */
+  *lim = newlim;
+}
+
+/* Checks that a string is valid UTF-8 as defined by RFC 3629: no overlong
+   forms, no surrogates, no code points above U+10FFFF.
+   Runs of ASCII characters are skipped a word at a time. */
+int utf8_valid (const char *str, size_t len)
+{
+  const size_t highbits = ((size_t)-1 / 0xFF) * 0x80;  /* 0x8080...80 */
+  const unsigned char *s = (const unsigned char*) str, *end = s + len;
+  while (s < end) {
+    unsigned c = *s;
+    size_t n;
+    if (c < 0x80) {
+      size_t w;
+      ++s;
+      while ((size_t)(end - s) >= sizeof (w)) {
+        memcpy (&w, s, sizeof (w));
+        if (w & highbits)
+          break;
+        s += sizeof (w);
+      }
+      continue;
+    }
+    if (c < 0xC2)      return 0;     /* continuation byte or overlong form */
+    else if (c < 0xE0) n = 1;
+    else if (c < 0xF0) n = 2;
+    else if (c < 0xF5) n = 3;
+    else               return 0;
+    if ((size_t)(end - s) <= n)
+      return 0;
+    if ((c == 0xE0 && s[1] < 0xA0) ||           /* overlong form */
+        (c == 0xED && s[1] > 0x9F) ||           /* surrogate */
+        (c == 0xF0 && s[1] < 0x90) ||           /* overlong form */
+        (c == 0xF4 && s[1] > 0x8F))             /* above U+10FFFF */
+      return 0;
+    for (++s; n; --n, ++s) {
+      if ((*s & 0xC0) != 0x80)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/* Returns the number of the bytes of the UTF-8 character at s[pos], which is 1
+   at the end of the string */
+size_t utf8_charlen (const char *s, size_t len, size_t pos) {
+  size_t n = 1;
+  while (pos + n < len && ((unsigned char) s[pos + n] & 0xC0) == 0x80)
+    ++n;
+  return n;
+}
+
 void *Lmalloc(lua_State *L, size_t size) {
   void *ud;
   lua_Alloc lalloc = lua_getallocf(L, &ud);
@@ -45,6 +139,364 @@ void Lfree(lua_State *L, void *p, size_t osize) {
   lalloc(ud, p, osize, 0);
 }
 
+/*
+ *  Required literals
+ *  *****************
+ *  literal_extract finds a literal substring that every match of a pattern
+ *  contains: the longest run of ordinary characters outside groups, or the run
+ *  the pattern starts with. It understands POSIX-style patterns (ERE, BRE and
+ *  their GNU and TRE extensions) and, with LIT_PCRE, the Perl syntax. The
+ *  parsing is conservative: whatever it does not understand ends the current
+ *  run, and an alternation outside groups leaves no literal at all.
+ *  When the whole pattern is a literal, the backends search for it instead of
+ *  running the regex engine; otherwise they use literal_skip to reject the
+ *  subjects without the literal, and to skip to its first occurrence when it is
+ *  a prefix of every match.
+ */
+
+enum { TK_CHAR, TK_BREAK, TK_QUANT, TK_OPEN, TK_CLOSE, TK_ALT, TK_FAIL };
+
+/* returns the index after the bracket expression starting at pat[i] ('['),
+   or 0 if it is not terminated */
+static size_t skip_bracket (const char *pat, size_t len, size_t i, int syntax) {
+  size_t j = i + 1;
+  if (j < len && pat[j] == '^') ++j;
+  if (j < len && pat[j] == ']') ++j;
+  while (j < len && pat[j] != ']') {
+    if (pat[j] == '[' && j + 1 < len &&
+        (pat[j+1] == ':' || pat[j+1] == '=' || pat[j+1] == '.')) {
+      char delim = pat[j+1];
+      for (j += 2; j + 1 < len && !(pat[j] == delim && pat[j+1] == ']'); ++j) ;
+      if (j + 1 >= len)
+        return 0;
+      j += 2;
+    }
+    else if (pat[j] == '\\' && (syntax & (LIT_BS_IN_LISTS | LIT_PCRE)))
+      j += 2;
+    else
+      ++j;
+  }
+  return j < len ? j + 1 : 0;
+}
+
+/* returns the index after the interval expression whose '{' is at pat[i],
+   or 0 if it is not terminated */
+static size_t skip_interval (const char *pat, size_t len, size_t i) {
+  const char *p = (const char*) memchr (pat + i, '}', len - i);
+  return p ? (size_t)(p - pat) + 1 : 0;
+}
+
+/* reads the token at pat[*pi]; stores an ordinary character in *ch */
+static int next_token (const char *pat, size_t len, size_t *pi, int syntax,
+                       char *ch) {
+  size_t i = *pi;
+  char c = pat[i];
+  int ext = syntax & (LIT_EXTENDED | LIT_PCRE);
+  *pi = i + 1;
+  switch (c) {
+    case '\\':
+      if (i + 1 >= len)
+        return TK_FAIL;
+      c = pat[i+1];
+      *pi = i + 2;
+      if (syntax & LIT_PCRE) {           /* \ quotes any ASCII non-alphanumeric */
+        if ((unsigned char)c < 0x80 && !isalnum ((unsigned char)c)) {
+          *ch = c;
+          return TK_CHAR;
+        }
+        return TK_BREAK;                 /* \d, \x41, \Q, \1, etc. */
+      }
+      switch (c) {
+        case '(': return ext ? TK_BREAK : TK_OPEN;
+        case ')': return ext ? TK_BREAK : TK_CLOSE;
+        case '|': return TK_ALT;
+        case '+': case '?': return TK_QUANT;
+        case '{':
+          return (*pi = skip_interval (pat, len, i + 2)) ? TK_QUANT : TK_FAIL;
+        case '.': case '[': case ']': case '*': case '^': case '$': case '\\':
+          *ch = c;
+          return TK_CHAR;
+        case 'x':                          /* TRE: \xHH or \x{HHHH} */
+          if (i + 2 < len && pat[i+2] == '{')
+            return (*pi = skip_interval (pat, len, i + 2)) ? TK_BREAK : TK_FAIL;
+          while (*pi < len && *pi < i + 4 && isxdigit ((unsigned char)pat[*pi]))
+            ++*pi;
+          return TK_BREAK;
+        default:
+          return TK_BREAK;               /* \w, \<, \b, \1, etc. */
+      }
+    case '(':
+      if (!ext) return TK_BREAK;
+      return (i + 1 < len && pat[i+1] == '?') ? TK_FAIL : TK_OPEN;  /* (?i) */
+    case ')':
+      return ext ? TK_CLOSE : TK_BREAK;
+    case '\n':                           /* GNU: newline may be an alternation */
+      if (syntax & LIT_PCRE) {
+        *ch = c;
+        return TK_CHAR;
+      }
+      return TK_ALT;
+    case '|':
+      return TK_ALT;
+    case '*': case '+': case '?':
+      return TK_QUANT;
+    case '{':
+      return (*pi = skip_interval (pat, len, i + 1)) ? TK_QUANT : TK_FAIL;
+    case '[':
+      return (*pi = skip_bracket (pat, len, i, syntax)) ? TK_BREAK : TK_FAIL;
+    case '.': case '^': case '$':
+      return TK_BREAK;
+    default:
+      *ch = c;
+      return TK_CHAR;
+  }
+}
+
+static void literal_set (lua_State *L, TLiteral *lit, const char *s, size_t len,
+                         int prefix, int whole) {
+  if ((lit->str = (char*) Lmalloc (L, len)) == NULL) {
+    luaL_error (L, "malloc failed");
+    return;
+  }
+  memcpy (lit->str, s, len);
+  lit->len = len;
+  lit->prefix = prefix;
+  lit->whole = whole;
+  lit->scan[0] = lit->scan[1] = (unsigned char)s[0];
+  lit->scan[2] = lit->scan[3] = (unsigned char)s[len-1];
+  lit->nscan = 1;
+}
+
+void literal_extract (lua_State *L, TLiteral *lit, const char *pat, size_t len,
+                      int syntax) {
+  char *buf;
+  size_t i = 0, cur = 0, pre = 0, best = 0, bestpos = 0;
+  int depth = 0, atstart = 1, curprefix = 0, charsonly = 1, tk = TK_BREAK;
+
+  memset (lit, 0, sizeof (TLiteral));
+  if (len == 0)
+    return;
+  if (syntax & LIT_WHOLE) {
+    literal_set (L, lit, pat, len, 1, 1);
+    return;
+  }
+  /* buf[0..len): the prefix run, then the best run; buf[len..2*len): the current run */
+  if ((buf = (char*) Lmalloc (L, 2 * len)) == NULL) {
+    luaL_error (L, "malloc failed");
+    return;
+  }
+  for (;;) {
+    char ch = 0;
+    int atend = (i >= len);
+    if (!atend)
+      tk = next_token (pat, len, &i, syntax, &ch);
+    else
+      tk = (depth == 0) ? TK_BREAK : TK_FAIL;
+    if (tk == TK_FAIL || (tk == TK_ALT && depth == 0))
+      break;
+    if (depth == 0 && tk == TK_CHAR) {
+      if (cur == 0)
+        curprefix = atstart;
+      buf[len + cur++] = ch;
+      continue;
+    }
+    if (!atend)
+      charsonly = 0;
+    if (depth == 0 && tk == TK_QUANT && cur > 0) {
+      /* the quantifier applies to the last (maybe multibyte) character */
+      while (cur > 0 && (buf[len + cur - 1] & 0xC0) == 0x80)
+        --cur;
+      if (cur > 0)
+        --cur;
+    }
+    if (depth == 0 && cur > 0) {         /* the run ends */
+      if (curprefix) {
+        memcpy (buf, buf + len, cur);
+        pre = cur;
+      }
+      else if (cur > best) {
+        memcpy (buf + pre, buf + len, cur);
+        best = cur;
+        bestpos = pre;
+      }
+      cur = 0;
+    }
+    atstart = 0;
+    if (tk == TK_OPEN)
+      ++depth;
+    else if (tk == TK_CLOSE && depth > 0)
+      --depth;
+    if (i >= len && depth == 0)
+      break;
+  }
+  if (tk != TK_FAIL && !(tk == TK_ALT && depth == 0)) {
+    /* a short prefix gives way to a longer literal */
+    if (pre > 0 && (pre >= 3 || pre >= best))
+      literal_set (L, lit, buf, pre, 1, charsonly);
+    else if (best > 0)
+      literal_set (L, lit, buf + bestpos, best, 0, 0);
+  }
+  Lfree (L, buf, 2 * len);
+}
+
+/* stores the characters folded to c in out[0..1]; fails if they are more */
+static int fold_scan (const unsigned char *fold, char c, unsigned char *out) {
+  int b, n = 0;
+  for (b = 0; b < 256; b++) {
+    if (fold[b] == (unsigned char)c) {
+      if (n == 2)
+        return 0;
+      out[n++] = (unsigned char)b;
+    }
+  }
+  if (n == 1)
+    out[1] = out[0];
+  return n > 0;
+}
+
+/* Makes the literal case-insensitive: the characters having the same image in
+   the lower-casing table lcc (the C locale's if NULL) are taken as equal.
+   Only a whole-pattern literal is kept. */
+void literal_fold (lua_State *L, TLiteral *lit, const unsigned char *lcc) {
+  size_t i;
+  int c;
+  if (!lit->whole) {
+    literal_free (L, lit);
+    return;
+  }
+  if ((lit->fold = (unsigned char*) Lmalloc (L, 256)) == NULL) {
+    luaL_error (L, "malloc failed");
+    return;
+  }
+  for (c = 0; c < 256; c++)
+    lit->fold[c] = lcc ? lcc[c] : (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+  for (i = 0; i < lit->len; i++)
+    lit->str[i] = (char) lit->fold[(unsigned char)lit->str[i]];
+  lit->nscan = fold_scan (lit->fold, lit->str[0], lit->scan) &&
+               fold_scan (lit->fold, lit->str[lit->len-1], lit->scan + 2);
+}
+
+/* Same as literal_fold, with the lower-casing of the current locale. Multibyte
+   locales are not supported, so no literal is kept with them. */
+void literal_fold_locale (lua_State *L, TLiteral *lit) {
+  unsigned char lcc[256];
+  int c;
+  if (MB_CUR_MAX > 1) {
+    literal_free (L, lit);
+    return;
+  }
+  for (c = 0; c < 256; c++)
+    lcc[c] = (unsigned char) tolower (c);
+  literal_fold (L, lit, lcc);
+}
+
+void literal_free (lua_State *L, TLiteral *lit) {
+  if (lit->str)
+    Lfree (L, lit->str, lit->len);
+  if (lit->fold)
+    Lfree (L, lit->fold, 256);
+  memset (lit, 0, sizeof (TLiteral));
+}
+
+static int literal_equal (const TLiteral *lit, const unsigned char *s) {
+  size_t i;
+  if (!lit->fold)
+    return memcmp (s, lit->str, lit->len) == 0;
+  for (i = 0; i < lit->len; i++) {
+    if (lit->fold[s[i]] != (unsigned char)lit->str[i])
+      return 0;
+  }
+  return 1;
+}
+
+#if defined(__SSE2__) && !defined(REX_NOSIMD)
+#include <emmintrin.h>
+#define LITERAL_SIMD
+
+/* Scans the positions [i..npos) 16 at a time for the ones holding a possible
+   first and last character of the literal. Returns the number of the
+   positions examined, all of them before *found (-1 if there is no match). */
+static size_t literal_scan (const TLiteral *lit, const unsigned char *s,
+                            size_t i, size_t npos, ptrdiff_t *found) {
+  const __m128i f0 = _mm_set1_epi8 ((char)lit->scan[0]);
+  const __m128i f1 = _mm_set1_epi8 ((char)lit->scan[1]);
+  const __m128i l0 = _mm_set1_epi8 ((char)lit->scan[2]);
+  const __m128i l1 = _mm_set1_epi8 ((char)lit->scan[3]);
+  for (; i + 16 <= npos; i += 16) {
+    __m128i a = _mm_loadu_si128 ((const __m128i*)(s + i));
+    __m128i b = _mm_loadu_si128 ((const __m128i*)(s + i + lit->len - 1));
+    __m128i eq = _mm_and_si128 (
+      _mm_or_si128 (_mm_cmpeq_epi8 (a, f0), _mm_cmpeq_epi8 (a, f1)),
+      _mm_or_si128 (_mm_cmpeq_epi8 (b, l0), _mm_cmpeq_epi8 (b, l1)));
+    unsigned mask = (unsigned) _mm_movemask_epi8 (eq);
+    while (mask) {
+      unsigned k = 0;
+      while (!(mask & (1u << k))) ++k;
+      if (literal_equal (lit, s + i + k)) {
+        *found = (ptrdiff_t)(i + k);
+        return i;
+      }
+      mask &= mask - 1;
+    }
+  }
+  *found = -1;
+  return i;
+}
+#endif
+
+/* Returns the offset of the first occurrence of the literal in the subject,
+   or -1. A literal with a rare first character is found fastest by memchr;
+   when the candidates it gives fail too often, the subject is scanned for
+   both the first and the last character. */
+ptrdiff_t literal_find (const TLiteral *lit, const char *subj, size_t len) {
+  const unsigned char *s = (const unsigned char*) subj;
+  size_t i = 0, npos;
+  if (lit->len == 0 || lit->len > len)
+    return lit->len == 0 ? 0 : -1;
+  npos = len - lit->len + 1;
+  if (!lit->fold) {
+    int misses = 0;
+    for (;;) {
+      const unsigned char *p = (const unsigned char*) memchr (s + i, lit->str[0], npos - i);
+      if (p == NULL)
+        return -1;
+      i = p - s;
+      if (memcmp (p + 1, lit->str + 1, lit->len - 1) == 0)
+        return (ptrdiff_t)i;
+      if (++i == npos)
+        return -1;
+#ifdef LITERAL_SIMD
+      if (++misses == 16 && lit->nscan)
+        break;
+#else
+      (void)misses;
+#endif
+    }
+  }
+#ifdef LITERAL_SIMD
+  if (lit->nscan) {
+    ptrdiff_t found;
+    i = literal_scan (lit, s, i, npos, &found);
+    if (found >= 0)
+      return found;
+  }
+#endif
+  for (; i < npos; i++) {
+    if (literal_equal (lit, s + i))
+      return (ptrdiff_t)i;
+  }
+  return -1;
+}
+
+/* Returns the number of the leading bytes of the subject where no match can
+   start, or -1 if no match can be found in the subject. */
+ptrdiff_t literal_skip (const TLiteral *lit, const char *s, size_t len) {
+  ptrdiff_t pos = literal_find (lit, s, len);
+  if (pos < 0)
+    return -1;
+  return lit->prefix ? pos : 0;
+}
+
 /* This function fills a table with string-number pairs.
    The table can be passed as the 1-st lua-function parameter,
    otherwise it is created. The return value is the filled table.
@@ -81,6 +533,91 @@ const char *get_flag_key (const flag_pair *fp, int val) {
   return NULL;
 }
 
+/*
+ *  Character tables for locales
+ *  ****************************
+ *  PCRE and PCRE2 tables made for a locale are cached process-wide and shared
+ *  by all the regex objects compiled with that locale. Where newlocale and
+ *  uselocale are available, the tables are made without changing the process
+ *  locale; otherwise setlocale is used. The callers serialize the calls to
+ *  locale_tables_acquire and locale_tables_release with their own lock.
+ */
+
+typedef struct tagLocaleTables {
+  struct tagLocaleTables *next;
+  const unsigned char *tables;
+  size_t refcount;
+  char name[1];
+} TLocaleTables;
+
+static TLocaleTables *locale_tables;
+
+static const unsigned char *make_locale_tables (const char *locale,
+                                                TMakeTables make) {
+  const unsigned char *tables;
+#ifdef LC_CTYPE_MASK
+  locale_t loc, old;
+  if ((loc = newlocale (LC_CTYPE_MASK, locale, (locale_t)0)) == (locale_t)0)
+    return NULL;
+  old = uselocale (loc);
+  tables = make ();
+  uselocale (old);
+  freelocale (loc);
+#else
+  char old_locale[256];
+  strcpy (old_locale, setlocale (LC_CTYPE, NULL));  /* store the locale */
+  if (NULL == setlocale (LC_CTYPE, locale))         /* set new locale */
+    return NULL;
+  tables = make ();
+  setlocale (LC_CTYPE, old_locale);                 /* restore the old locale */
+#endif
+  return tables;
+}
+
+/* Returns referenced tables for the locale, made by make if they are not
+   cached yet, or NULL (and an error message). */
+const unsigned char *locale_tables_acquire (const char *locale, TMakeTables make,
+                                            const char **errmsg) {
+  TLocaleTables *e;
+  size_t len = strlen (locale);
+  for (e = locale_tables; e; e = e->next) {
+    if (strcmp (e->name, locale) == 0)
+      break;
+  }
+  if (e)
+    e->refcount++;
+  else if ((e = (TLocaleTables*) malloc (sizeof (TLocaleTables) + len)) == NULL)
+    *errmsg = "malloc failed";
+  else if ((e->tables = make_locale_tables (locale, make)) == NULL) {
+    free (e);
+    e = NULL;
+    *errmsg = "cannot set locale";
+  }
+  else {
+    memcpy (e->name, locale, len + 1);
+    e->refcount = 1;
+    e->next = locale_tables;
+    locale_tables = e;
+  }
+  return e ? e->tables : NULL;
+}
+
+/* Drops a reference to the tables; returns 1 if they are no longer used, and
+   are to be freed by the caller. */
+int locale_tables_release (const unsigned char *tables) {
+  TLocaleTables **p, *e;
+  for (p = &locale_tables; (e = *p) != NULL; p = &e->next) {
+    if (e->tables == tables) {
+      if (--e->refcount > 0)
+        return 0;
+      *p = e->next;
+      free (e);
+      return 1;
+    }
+  }
+  return 0;
+}
+
 /* Classes */
 
 /*
@@ -265,6 +802,165 @@ int luaL_typerror (lua_State *L, int narg, const char *tname) {
 }
 #endif
 
+/* Memory-mapped files
+ ******************************************************************************
+ */
+
+#define MMAP_TYPENAME "rex_mmap"
+
+typedef struct {
+  char  *addr;               /* the bytes asked for */
+  size_t len;
+  void  *map;                /* the mapping, from a page boundary on */
+  size_t maplen;
+  int    closed;
+} TMmap;
+
+static TMmap *check_mmap (lua_State *L) {
+  return (TMmap*) luaL_checkudata (L, 1, MMAP_TYPENAME);
+}
+
+static void mmap_unmap (TMmap *m) {
+  if (!m->closed) {
+    m->closed = 1;
+#ifndef _WIN32
+    if (m->map)
+      munmap (m->map, m->maplen);
+#endif
+    m->map = NULL;
+    m->addr = NULL;
+    m->len = 0;
+  }
+}
+
+static const char *mmap_getbuffer (lua_State *L, int pos, size_t *len) {
+  TMmap *m = (TMmap*) lua_touserdata (L, pos);
+  *len = m->len;
+  return m->closed ? NULL : m->addr;
+}
+
+static const TRexBuffer mmap_buffer = { mmap_getbuffer };
+
+static int mmap_topointer (lua_State *L) {
+  TMmap *m = check_mmap (L);
+  if (m->closed)
+    return luaL_error (L, "attempt to use a closed " MMAP_TYPENAME);
+  lua_pushlightuserdata (L, m->addr);
+  return 1;
+}
+
+static int mmap_len (lua_State *L) {
+  lua_pushinteger (L, (lua_Integer) check_mmap (L)->len);
+  return 1;
+}
+
+static int mmap_close (lua_State *L) {
+  mmap_unmap (check_mmap (L));
+  return 0;
+}
+
+static int mmap_tostring (lua_State *L) {
+  TMmap *m = check_mmap (L);
+  if (m->closed)
+    lua_pushfstring (L, "%s (closed)", MMAP_TYPENAME);
+  else
+    lua_pushfstring (L, "%s (%p)", MMAP_TYPENAME, (void*)m);
+  return 1;
+}
+
+static const luaL_Reg mmap_meta[] = {
+  { "topointer",  mmap_topointer },
+  { "close",      mmap_close },
+  { "__len",      mmap_len },
+  { "__gc",       mmap_close },
+  { "__close",    mmap_close },
+  { "__tostring", mmap_tostring },
+  { NULL, NULL }
+};
+
+#ifndef _WIN32
+/* pushes nil and the message of errno, like io.open */
+static int mmap_fail (lua_State *L, const char *path, int fd) {
+  int err = errno;
+  if (fd >= 0)
+    close (fd);
+  lua_pushnil (L);
+  lua_pushfstring (L, "%s: %s", path, strerror (err));
+  return 2;
+}
+#endif
+
+/* rex.mmap (path, [offset], [length]): maps the file read-only; offset is a
+   0-based byte offset, and the length defaults to the rest of the file.
+   Returns nil and a message if the file cannot be mapped. */
+int rex_mmap (lua_State *L) {
+  const char *path = luaL_checkstring (L, 1);
+  lua_Integer offset = luaL_optinteger (L, 2, 0);
+  lua_Integer length = luaL_optinteger (L, 3, 0);
+#ifdef _WIN32
+  luaL_argcheck (L, offset >= 0, 2, "negative offset");
+  lua_pushnil (L);
+  lua_pushliteral (L, "mmap is not supported on this platform");
+  return 2;
+#else
+  TMmap *m;
+  struct stat st;
+  size_t pageoff;
+  int fd;
+  luaL_argcheck (L, offset >= 0, 2, "negative offset");
+
+  m = (TMmap*) lua_newuserdata (L, sizeof (TMmap));
+  memset (m, 0, sizeof (TMmap));
+  m->closed = 1;                  /* until mapped */
+  if (luaL_newmetatable (L, MMAP_TYPENAME)) {
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+#if LUA_VERSION_NUM == 501
+    luaL_register (L, NULL, mmap_meta);
+#else
+    luaL_setfuncs (L, mmap_meta, 0);
+#endif
+    lua_pushlightuserdata (L, (void*) &mmap_buffer);
+    lua_setfield (L, -2, REX_BUFFER_KEY);
+  }
+  lua_setmetatable (L, -2);
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) < 0)
+    return mmap_fail (L, path, fd);
+  if (offset > (lua_Integer) st.st_size) {
+    close (fd);
+    return luaL_argerror (L, 2, "offset past the end of the file");
+  }
+  if (lua_isnoneornil (L, 3))
+    length = (lua_Integer) st.st_size - offset;
+  if (length < 0 || length > (lua_Integer) st.st_size - offset) {
+    close (fd);
+    return luaL_argerror (L, 3, "length out of the file");
+  }
+  pageoff = (size_t) (offset % sysconf (_SC_PAGESIZE));
+  if (length > 0) {
+    m->maplen = (size_t) length + pageoff;
+    m->map = mmap (NULL, m->maplen, PROT_READ, MAP_PRIVATE, fd,
+                   (off_t) (offset - pageoff));
+    if (m->map == MAP_FAILED) {
+      m->map = NULL;
+      return mmap_fail (L, path, fd);
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise (m->map, m->maplen, MADV_SEQUENTIAL);
+#endif
+    m->addr = (char*) m->map + pageoff;
+  }
+  else
+    m->addr = (char*) "";         /* nothing to map */
+  close (fd);                     /* the mapping stays valid */
+  m->len = (size_t) length;
+  m->closed = 0;
+  return 1;
+#endif
+}
+
 #ifndef REX_NOEMBEDDEDTEST
 static int ud_topointer (lua_State *L) {
   lua_pushlightuserdata (L, lua_touserdata (L, 1));
@@ -276,10 +972,18 @@ static int ud_len (lua_State *L) {
   return 1;
 }
 
-/* for testing purposes only */
+static const char *ud_getbuffer (lua_State *L, int pos, size_t *len) {
+  *len = lua_objlen (L, pos);
+  return (const char*) lua_touserdata (L, pos);
+}
+
+static const TRexBuffer ud_buffer = { ud_getbuffer };
+
+/* for testing purposes only; the C buffer protocol is added if arg. 2 is true */
 int newmembuffer (lua_State *L) {
   size_t len;
   const char* s = luaL_checklstring (L, 1, &len);
+  int proto = lua_toboolean (L, 2);
   void *ud = lua_newuserdata (L, len);
   memcpy (ud, s, len);
   lua_newtable (L); /* metatable */
@@ -289,6 +993,10 @@ int newmembuffer (lua_State *L) {
   lua_setfield (L, -2, "topointer");
   lua_pushcfunction (L, ud_len);
   lua_setfield (L, -2, "__len");
+  if (proto) {
+    lua_pushlightuserdata (L, (void*) &ud_buffer);
+    lua_setfield (L, -2, REX_BUFFER_KEY);
+  }
   lua_setmetatable (L, -2);
   return 1;
 }
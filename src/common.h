@@ -4,6 +4,7 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stddef.h>
 #include "lua.h"
 
 #if LUA_VERSION_NUM > 501
@@ -22,6 +23,21 @@
 #define GSUB_UNLIMITED   -1
 #define GSUB_CONDITIONAL -2
 
+/* The engines whose offsets are ints are given a subject longer than
+   REX_WINDOW bytes one window at a time. Windows overlap by
+   REX_WINDOW_OVERLAP bytes: a longer match across the edge of a window may
+   be missed. */
+#ifndef REX_WINDOW
+#  define REX_WINDOW ((size_t)1 << 30)
+#endif
+#ifndef REX_WINDOW_OVERLAP
+#  define REX_WINDOW_OVERLAP ((size_t)1 << 20)
+#endif
+/* bytes before the offset that a window keeps for lookbehinds and \b */
+#ifndef REX_WINDOW_MARGIN
+#  define REX_WINDOW_MARGIN 256
+#endif
+
 /* Common structs and functions */
 
 typedef struct {
@@ -29,6 +45,28 @@ typedef struct {
   int val;
 } flag_pair;
 
+typedef struct {            /* match limits (0: the library's built-in limit) */
+  unsigned long match;
+  unsigned long depth;
+  unsigned long heap;              /* in kibibytes */
+} TMatchLimits;
+
+typedef struct {            /* literal substring present in every match */
+  char  *str;
+  size_t len;                      /* 0: none found */
+  int    prefix;                   /* every match starts with it */
+  int    whole;                    /* every match is it */
+  unsigned char *fold;             /* lower-casing table, or NULL */
+  unsigned char scan[4];           /* possible first (2) and last (2) chars */
+  int    nscan;                    /* scan is usable */
+} TLiteral;
+
+/* Syntax of a pattern for literal_extract */
+#define LIT_EXTENDED     1         /* groups are ( ), not \( \) */
+#define LIT_BS_IN_LISTS  2         /* backslash escapes in bracket expressions */
+#define LIT_WHOLE        4         /* the pattern is a literal string */
+#define LIT_PCRE         8         /* Perl syntax */
+
 typedef struct {            /* compile arguments */
   const char * pattern;
   size_t       patlen;
@@ -40,12 +78,13 @@ typedef struct {            /* compile arguments */
   void       * syntax;             /* Oniguruma */
   const unsigned char * translate; /* GNU */
   int          gnusyn;             /* GNU */
+  TMatchLimits limits;             /* PCRE, PCRE2 */
 } TArgComp;
 
 typedef struct {            /* exec arguments */
   const char * text;
   size_t       textlen;
-  int          startoffset;
+  size_t       startoffset;
   int          eflags;
   int          funcpos;
   int          maxmatch;
@@ -55,6 +94,17 @@ typedef struct {            /* exec arguments */
   size_t       wscount;           /* PCRE: dfa_exec */
 } TArgExec;
 
+/* C buffer protocol: a subject whose metatable has the field REX_BUFFER_KEY,
+   a light userdata pointing to a TRexBuffer, is read through its getbuffer
+   function rather than through its topointer method and __len metamethod */
+#define REX_BUFFER_KEY "__rex_buffer"
+
+typedef struct {
+  /* returns the address of the subject at stack index pos and sets *len to
+     its length, without calling Lua; returns NULL if it is not available */
+  const char * (*getbuffer) (lua_State *L, int pos, size_t *len);
+} TRexBuffer;
+
 struct tagFreeList; /* forward declaration */
 
 struct tagBuffer {
@@ -92,12 +142,29 @@ void bufferZ_addnum (TBuffer *buf, size_t num);
 
 int  get_int_field (lua_State *L, const char* field);
 void set_int_field (lua_State *L, const char* field, int val);
+void get_match_limits (lua_State *L, int pos, TMatchLimits *lim);
+void set_default_limits (lua_State *L, int pos, TMatchLimits *lim);
+int  utf8_valid (const char *str, size_t len);
+size_t utf8_charlen (const char *s, size_t len, size_t pos);
+void literal_extract (lua_State *L, TLiteral *lit, const char *pat, size_t len,
+                      int syntax);
+void literal_fold (lua_State *L, TLiteral *lit, const unsigned char *lcc);
+void literal_fold_locale (lua_State *L, TLiteral *lit);
+void literal_free (lua_State *L, TLiteral *lit);
+ptrdiff_t literal_find (const TLiteral *lit, const char *s, size_t len);
+ptrdiff_t literal_skip (const TLiteral *lit, const char *s, size_t len);
+typedef const unsigned char * (*TMakeTables) (void);
+const unsigned char *locale_tables_acquire (const char *locale, TMakeTables make,
+                                            const char **errmsg);
+int  locale_tables_release (const unsigned char *tables);
 int  get_flags (lua_State *L, const flag_pair **arr);
 const char *get_flag_key (const flag_pair *fp, int val);
 void *Lmalloc (lua_State *L, size_t size);
 void *Lrealloc (lua_State *L, void *p, size_t osize, size_t nsize);
 void Lfree (lua_State *L, void *p, size_t size);
 
+int  rex_mmap (lua_State *L);
+
 #ifndef REX_NOEMBEDDEDTEST
 int newmembuffer (lua_State *L);
 #endif
@@ -38,12 +38,16 @@
 static const unsigned char *gettranslate (lua_State *L, int pos);
 #define ALG_GETCARGS(L,pos,argC)  argC->translate = gettranslate (L, pos)
 
+static int cache_pushlarg (lua_State *L, const TArgComp *argC);
+#define ALG_CACHE_PUSHLARG(L,argC)  cache_pushlarg(L,argC)
+#define ALG_CACHE_FREEARGS(argC)    free ((void *) (argC)->translate)
+
 #define ALG_NOMATCH(res)   ((res) == -1 || (res) == -2)
 #define ALG_ISMATCH(res)   ((res) >= 0)
-#define ALG_SUBBEG(ud,n)   ud->match.start[n]
-#define ALG_SUBEND(ud,n)   ud->match.end[n]
+#define ALG_SUBBEG(ud,n)   ((ud)->shift + (ud)->match.start[n])
+#define ALG_SUBEND(ud,n)   ((ud)->shift + (ud)->match.end[n])
 #define ALG_SUBLEN(ud,n)   (ALG_SUBEND(ud,n) - ALG_SUBBEG(ud,n))
-#define ALG_SUBVALID(ud,n) (ALG_SUBBEG(ud,n) >= 0)
+#define ALG_SUBVALID(ud,n) ((ud)->match.start[n] >= 0)
 #define ALG_NSUB(ud)     ((int)ud->r.re_nsub)
 
 #define ALG_PUSHSUB(L,ud,text,n) \
@@ -62,12 +66,17 @@ static const unsigned char *gettranslate (lua_State *L, int pos);
 typedef struct {
   struct re_pattern_buffer r;
   struct re_registers      match;
+  size_t                   shift;  /* offset of the window the match was found in */
+  TLiteral                 lit;
   int                      freed;
   const char *             errmsg;
 } TGnu;
 
 #define TUserdata TGnu
 
+static int test_exec (TGnu *ud, TArgExec *argE);
+#define ALG_TEST_EXEC(ud,argE) test_exec (ud, argE)
+
 #include "../algo.h"
 
 /*  Functions
@@ -119,6 +128,15 @@ static const unsigned char *gettranslate (lua_State *L, int pos) {
   return translate;
 }
 
+/* pushes the translate table as a part of the compiled-pattern cache key */
+static int cache_pushlarg (lua_State *L, const TArgComp *argC) {
+  if (argC->translate)
+    lua_pushlstring (L, (const char *) argC->translate, ALG_TRANSLATE_SIZE);
+  else
+    lua_pushliteral (L, "");
+  return 1;
+}
+
 static void seteflags (TGnu *ud, TArgExec *argE) {
   ud->r.not_bol = (argE->eflags & GNU_NOTBOL) != 0;
   ud->r.not_eol = (argE->eflags & GNU_NOTEOL) != 0;
@@ -142,6 +160,29 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TGnu **pud) {
       ud->errmsg = res;
       ret = generate_error (L, ud, 0);
   } else {
+    int syntax = 0;
+    if (argC->cflags & RE_NO_BK_PARENS)
+      syntax |= LIT_EXTENDED;
+    if (argC->cflags & RE_BACKSLASH_ESCAPE_IN_LISTS)
+      syntax |= LIT_BS_IN_LISTS;
+    literal_extract (L, &ud->lit, argC->pattern, argC->patlen, syntax);
+    if (argC->translate) {
+      if ((argC->cflags & RE_ICASE) || MB_CUR_MAX > 1)
+        literal_free (L, &ud->lit);
+      else
+        literal_fold (L, &ud->lit, argC->translate);
+    }
+    else if (argC->cflags & RE_ICASE)
+      literal_fold_locale (L, &ud->lit);
+    if (ud->lit.whole) {
+      /* the registers of a match, which re_search grows when it needs */
+      ud->match.num_regs = 2;
+      ud->match.start = (regoff_t *) malloc (2 * sizeof (regoff_t));
+      ud->match.end = (regoff_t *) malloc (2 * sizeof (regoff_t));
+      if (!ud->match.start || !ud->match.end)
+        luaL_error (L, "malloc failed");
+      ud->r.regs_allocated = REGS_REALLOCATE;
+    }
     lua_pushvalue (L, ALG_ENVIRONINDEX);
     lua_setmetatable (L, -2);
 
@@ -152,50 +193,121 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TGnu **pud) {
   return ret;
 }
 
+/* Searches text[0..len). A pattern that is a literal string is just searched
+   for forward. Otherwise the subjects lacking the required literal are
+   rejected, and when it is a prefix of every match, the forward search starts
+   at its first occurrence. */
+/* regs is &ud->match, or NULL when only the fact of matching is wanted */
+static int gnu_search1 (TGnu *ud, const char *text, int len, int backward,
+                        struct re_registers *regs) {
+  ptrdiff_t skip;
+  if (ud->lit.whole && !backward) {
+    ptrdiff_t pos = literal_find (&ud->lit, text, len);
+    if (pos >= 0 && regs) {
+      regs->start[0] = pos;
+      regs->end[0] = pos + ud->lit.len;
+    }
+    return (int)pos;
+  }
+  if ((skip = literal_skip (&ud->lit, text, len)) < 0)
+    return -1;
+  if (backward)
+    return re_search (&ud->r, text, len, len, -len, regs);
+  else
+    return re_search (&ud->r, text, len, (int)skip, len - (int)skip, regs);
+}
+
+/* The same for a subject of any length: one longer than REX_WINDOW is
+   searched one window at a time, from its end backward if backward is set,
+   and the offsets of the match are relative to ud->shift. A match that may go
+   on past the window is searched for again in a window starting where it
+   does, so the registers are filled in a window even for a test. */
+static int gnu_search (TGnu *ud, const char *text, size_t len, int backward,
+                       struct re_registers *regs) {
+  int res;
+  size_t so = 0, end = len;
+  unsigned not_bol = ud->r.not_bol, not_eol = ud->r.not_eol;
+  if (backward) {
+    for (;;) {
+      so = end > REX_WINDOW ? end - REX_WINDOW : 0;
+      ud->r.not_bol = so > 0 ? 1 : not_bol;
+      ud->r.not_eol = end < len ? 1 : not_eol;
+      res = gnu_search1 (ud, text + so, (int)(end - so), 1, regs);
+      if (res != -1 || so == 0)
+        break;
+      end = so + REX_WINDOW_OVERLAP;
+    }
+  }
+  else {
+    for (;;) {
+      if (len - so <= REX_WINDOW) {
+        res = gnu_search1 (ud, text + so, (int)(len - so), 0, regs);
+        break;
+      }
+      ud->r.not_eol = 1;
+      res = gnu_search1 (ud, text + so, (int)REX_WINDOW, 0, &ud->match);
+      ud->r.not_eol = not_eol;
+      if (res == -1)
+        so += REX_WINDOW - REX_WINDOW_OVERLAP;
+      else if (res > 0 &&
+               (size_t)ud->match.end[0] > REX_WINDOW - REX_WINDOW_OVERLAP)
+        so += res;
+      else
+        break;
+      ud->r.not_bol = 1;
+    }
+  }
+  ud->r.not_bol = not_bol;
+  ud->r.not_eol = not_eol;
+  ud->shift = so;
+  return res;
+}
+
 static int gmatch_exec (TUserdata *ud, TArgExec *argE) {
   seteflags (ud, argE);
   if (argE->startoffset > 0)
     ud->r.not_bol = 1;
   argE->text += argE->startoffset;
   argE->textlen -= argE->startoffset;
-  if (argE->eflags & GNU_BACKWARD)
-    return re_search (&ud->r, argE->text, argE->textlen, argE->textlen, -argE->textlen, &ud->match);
-  else
-    return re_search (&ud->r, argE->text, argE->textlen, 0, argE->textlen, &ud->match);
+  return gnu_search (ud, argE->text, argE->textlen, argE->eflags & GNU_BACKWARD,
+                     &ud->match);
 }
 
-static void gmatch_pushsubject (lua_State *L, TArgExec *argE) {
-  lua_pushlstring (L, argE->text, argE->textlen);
+static void gmatch_pushsubject (lua_State *L, TArgExec *argE, int pos) {
+  (void)argE;
+  lua_pushvalue (L, pos);
 }
 
 static int findmatch_exec (TGnu *ud, TArgExec *argE) {
   argE->text += argE->startoffset;
   argE->textlen -= argE->startoffset;
   seteflags (ud, argE);
-  if (argE->eflags & GNU_BACKWARD)
-    return re_search (&ud->r, argE->text, argE->textlen, argE->textlen, -argE->textlen, &ud->match);
-  else
-    return re_search (&ud->r, argE->text, argE->textlen, 0, argE->textlen, &ud->match);
+  return gnu_search (ud, argE->text, argE->textlen, argE->eflags & GNU_BACKWARD,
+                     &ud->match);
 }
 
-static int gsub_exec (TGnu *ud, TArgExec *argE, int st) {
+static int test_exec (TGnu *ud, TArgExec *argE) {
+  argE->text += argE->startoffset;
+  argE->textlen -= argE->startoffset;
+  seteflags (ud, argE);
+  return gnu_search (ud, argE->text, argE->textlen, argE->eflags & GNU_BACKWARD,
+                     NULL);
+}
+
+static int gsub_exec (TGnu *ud, TArgExec *argE, size_t st) {
   seteflags (ud, argE);
   if (st > 0)
     ud->r.not_bol = 1;
-  if (argE->eflags & GNU_BACKWARD)
-    return re_search (&ud->r, argE->text + st, argE->textlen - st, argE->textlen - st, -(argE->textlen - st), &ud->match);
-  else
-    return re_search (&ud->r, argE->text + st, argE->textlen - st, 0, argE->textlen - st, &ud->match);
+  return gnu_search (ud, argE->text + st, argE->textlen - st, argE->eflags & GNU_BACKWARD,
+                     &ud->match);
 }
 
-static int split_exec (TGnu *ud, TArgExec *argE, int offset) {
+static int split_exec (TGnu *ud, TArgExec *argE, size_t offset) {
   seteflags (ud, argE);
   if (offset > 0)
     ud->r.not_bol = 1;
-  if (argE->eflags & GNU_BACKWARD)
-    return re_search (&ud->r, argE->text + offset, argE->textlen - offset, argE->textlen - offset, -(argE->textlen - offset), &ud->match);
-  else
-    return re_search (&ud->r, argE->text + offset, argE->textlen - offset, 0, argE->textlen - offset, &ud->match);
+  return gnu_search (ud, argE->text + offset, argE->textlen - offset, argE->eflags & GNU_BACKWARD,
+                     &ud->match);
 }
 
 static int Gnu_gc (lua_State *L) {
@@ -205,6 +317,7 @@ static int Gnu_gc (lua_State *L) {
     regfree (&ud->r);
     free (ud->match.start);
     free (ud->match.end);
+    literal_free (L, &ud->lit);
   }
   return 0;
 }
@@ -289,6 +402,13 @@ static const luaL_Reg r_methods[] = {
   { "tfind",      algm_tfind },    /* old match */
   { "find",       algm_find },
   { "match",      algm_match },
+  { "test",       algm_test },
+  { "search",     algm_search },
+  { "find_all",   algm_find_all },
+  { "grep",       algm_grep },
+  { "test_batch", algm_test_batch },
+  { "exec_batch", algm_exec_batch },
+  { "count_batch", algm_count_batch },
   { "__gc",       Gnu_gc },
   { "__tostring", Gnu_tostring },
   { NULL, NULL}
@@ -297,11 +417,17 @@ static const luaL_Reg r_methods[] = {
 static const luaL_Reg r_functions[] = {
   { "match",      algf_match },
   { "find",       algf_find },
+  { "test",       algf_test },
+  { "search",     algf_search },
+  { "find_all",   algf_find_all },
   { "gmatch",     algf_gmatch },
   { "gsub",       algf_gsub },
   { "count",      algf_count },
   { "split",      algf_split },
   { "new",        algf_new },
+  { "cache_stats", algf_cache_stats },
+  { "cache_clear", algf_cache_clear },
+  { "cache_config", algf_cache_config },
   { "flags",      Gnu_get_flags },
   { NULL, NULL }
 };
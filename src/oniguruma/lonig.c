@@ -34,12 +34,15 @@ static int getcflags (lua_State *L, int pos);
 static void checkarg_compile (lua_State *L, int pos, TArgComp *argC);
 #define ALG_GETCARGS(a,b,c)  checkarg_compile(a,b,c)
 
+static int cache_pushlarg (lua_State *L, const TArgComp *argC);
+#define ALG_CACHE_PUSHLARG(L,argC)  cache_pushlarg(L,argC)
+
 #define ALG_NOMATCH(res)   ((res) == ONIG_MISMATCH)
 #define ALG_ISMATCH(res)   ((res) >= 0)
-#define ALG_SUBBEG(ud,n)   ud->region->beg[n]
-#define ALG_SUBEND(ud,n)   ud->region->end[n]
+#define ALG_SUBBEG(ud,n)   ((ud)->shift + (ud)->region->beg[n])
+#define ALG_SUBEND(ud,n)   ((ud)->shift + (ud)->region->end[n])
 #define ALG_SUBLEN(ud,n)   (ALG_SUBEND(ud,n) - ALG_SUBBEG(ud,n))
-#define ALG_SUBVALID(ud,n) (ALG_SUBBEG(ud,n) >= 0)
+#define ALG_SUBVALID(ud,n) ((ud)->region->beg[n] >= 0)
 #define ALG_NSUB(ud)       onig_number_of_captures(ud->reg)
 
 #define ALG_PUSHSUB(L,ud,text,n) \
@@ -59,13 +62,17 @@ static void checkarg_compile (lua_State *L, int pos, TArgComp *argC);
 typedef struct {
   regex_t *reg;
   OnigRegion *region;
+  size_t shift;                    /* offset of the window the match was found in */
   OnigErrorInfo einfo;
+  int names;                       /* names table (registry reference), or 0 */
 } TOnig;
 
 #define TUserdata TOnig
 
-static void do_named_subpatterns (lua_State *L, TOnig *ud, const char *text);
-#  define DO_NAMED_SUBPATTERNS do_named_subpatterns
+#define ALG_NAMES(ud) ((ud)->names)
+
+static int test_exec (TOnig *ud, TArgExec *argE);
+#define ALG_TEST_EXEC(ud,argE) test_exec (ud, argE)
 
 #include "../algo.h"
 
@@ -199,6 +206,12 @@ static void checkarg_compile (lua_State *L, int pos, TArgComp *argC) {
   argC->syntax = getsyntax (L, pos + 1);
 }
 
+/* pushes the encoding and the syntax as a part of the compiled-pattern cache key */
+static int cache_pushlarg (lua_State *L, const TArgComp *argC) {
+  lua_pushfstring (L, "%p%p", (const void*)argC->locale, argC->syntax);
+  return 1;
+}
+
 /*
    rex.setdefaultsyntax (syntax)
    @param syntax: one of the predefined strings listed in array 'Syntaxes'
@@ -210,6 +223,17 @@ static int LOnig_setdefaultsyntax (lua_State *L) {
   return 0;
 }
 
+/* adds the groups of a name to the names table on the stack top */
+static int name_callback (const UChar *name, const UChar *name_end,
+      int ngroups, int *groupnumlist, regex_t *reg, void *arg)
+{
+  int i;
+  (void) reg;
+  for (i = 0; i < ngroups; i++)
+    names_add ((lua_State*)arg, (const char*)name, name_end - name, groupnumlist[i]);
+  return 0;
+}
+
 static int compile_regex (lua_State *L, const TArgComp *argC, TOnig **pud) {
   TOnig *ud;
   int r;
@@ -228,61 +252,85 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TOnig **pud) {
   if ((ud->region = onig_region_new()) == NULL)
     return luaL_error(L, "`onig_region_new' failed");
 
+  if (onig_number_of_names (ud->reg) > 0) {
+    lua_newtable (L);
+    onig_foreach_name (ud->reg, name_callback, L);
+    ud->names = names_ref (L);
+  }
+
   if (pud) *pud = ud;
   return 1;
 }
 
-typedef struct {
-  lua_State *L;
-  TOnig *ud;
-  const char *text;
-} TNameArg;
 
-static int name_callback (const UChar *name, const UChar *name_end,
-      int ngroups, int *groupnumlist, regex_t *reg, void *arg)
-{
-  (void) ngroups;
-  (void) groupnumlist;
-  TNameArg *A = (TNameArg*)arg;
-  int num = onig_name_to_backref_number(reg, name, name_end, A->ud->region);
-  lua_pushlstring (A->L, (const char*)name, name_end - name);
-  ALG_PUSHSUB_OR_FALSE (A->L, A->ud, A->text, num);
-  lua_rawset (A->L, -3);
-  return 0;
-}
-
-/* the target table must be on lua stack top */
-static void do_named_subpatterns (lua_State *L, TOnig *ud, const char *text) {
-  if (onig_number_of_names (ud->reg) > 0) {
-    TNameArg A = { L, ud, text };
-    onig_foreach_name(ud->reg, name_callback, &A);
+/* Searches the subject from offset, recording the groups in region (NULL:
+   none). A subject whose offsets could overflow an int is searched one window
+   at a time, and the offsets of the match are relative to ud->shift. A match
+   that may go on past the window is searched for again in a window starting
+   where it does. */
+static int search (TOnig *ud, TArgExec *argE, size_t offset, OnigRegion *region) {
+  const char *end = argE->text + argE->textlen;
+  size_t so;
+  int res;
+  ud->shift = 0;
+  if (region)
+    onig_region_clear (region);
+  if (argE->textlen <= REX_WINDOW)
+    return onig_search (ud->reg, (CUC)argE->text, (CUC)end,
+                        (CUC)argE->text + offset, (CUC)end, region, argE->eflags);
+  for (;;) {
+    size_t len;
+    int eflags = argE->eflags;
+    so = offset > REX_WINDOW_MARGIN ? offset - REX_WINDOW_MARGIN : 0;
+    len = argE->textlen - so;
+    if (so > 0)
+      eflags |= ONIG_OPTION_NOTBOL;
+    if (len > REX_WINDOW) {
+      len = REX_WINDOW;
+      eflags |= ONIG_OPTION_NOTEOL;
+    }
+    end = argE->text + so + len;
+    res = onig_search (ud->reg, (CUC)argE->text + so, (CUC)end,
+                       (CUC)argE->text + offset, (CUC)end, region, eflags);
+    if (so + len == argE->textlen)
+      break;
+    if (res == ONIG_MISMATCH)
+      offset = so + len - REX_WINDOW_OVERLAP;
+    else if (res >= 0 && region && (size_t)region->beg[0] > offset - so &&
+             (size_t)region->end[0] > len - REX_WINDOW_OVERLAP) {
+      offset = so + region->beg[0];
+      onig_region_clear (region);
+    }
+    else
+      break;
   }
+  ud->shift = so;
+  return res;
 }
 
 static int findmatch_exec (TUserdata *ud, TArgExec *argE) {
-  const char *end = argE->text + argE->textlen;
-  onig_region_clear(ud->region);
-  return onig_search (ud->reg, (CUC)argE->text, (CUC)end,
-                      (CUC)argE->text + argE->startoffset, (CUC)end,
-                      ud->region, argE->eflags);
+  return search (ud, argE, argE->startoffset, ud->region);
 }
 
-static void gmatch_pushsubject (lua_State *L, TArgExec *argE) {
-  lua_pushlstring (L, argE->text, argE->textlen);
+/* a NULL region spares onig_search recording the groups */
+static int test_exec (TOnig *ud, TArgExec *argE) {
+  return search (ud, argE, argE->startoffset, NULL);
+}
+
+static void gmatch_pushsubject (lua_State *L, TArgExec *argE, int pos) {
+  (void)argE;
+  lua_pushvalue (L, pos);
 }
 
 static int gmatch_exec (TOnig *ud, TArgExec *argE) {
   return findmatch_exec(ud, argE);
 }
 
-static int gsub_exec (TOnig *ud, TArgExec *argE, int st) {
-  const char *end = argE->text + argE->textlen;
-  onig_region_clear(ud->region);
-  return onig_search (ud->reg, (CUC)argE->text, (CUC)end, (CUC)argE->text + st,
-    (CUC)end, ud->region, argE->eflags);
+static int gsub_exec (TOnig *ud, TArgExec *argE, size_t st) {
+  return search (ud, argE, st, ud->region);
 }
 
-static int split_exec (TOnig *ud, TArgExec *argE, int st) {
+static int split_exec (TOnig *ud, TArgExec *argE, size_t st) {
   return gsub_exec(ud, argE, st);
 }
 
@@ -302,6 +350,10 @@ static int LOnig_gc (lua_State *L) {
     onig_region_free (ud->region, 1);
     ud->region = NULL;
   }
+  if (ud->names) {
+    luaL_unref (L, LUA_REGISTRYINDEX, ud->names);
+    ud->names = 0;
+  }
   return 0;
 }
 
@@ -344,6 +396,13 @@ static const luaL_Reg r_methods[] = {
   { "tfind",       algm_tfind },    /* old name: match */
   { "find",        algm_find },
   { "match",       algm_match },
+  { "test",        algm_test },
+  { "search",      algm_search },
+  { "find_all",    algm_find_all },
+  { "grep",        algm_grep },
+  { "test_batch",  algm_test_batch },
+  { "exec_batch",  algm_exec_batch },
+  { "count_batch", algm_count_batch },
   { "capturecount", LOnig_capturecount },
   { "__gc",        LOnig_gc },
   { "__tostring",  LOnig_tostring },
@@ -353,11 +412,17 @@ static const luaL_Reg r_methods[] = {
 static const luaL_Reg r_functions[] = {
   { "match",            algf_match },
   { "find",             algf_find },
+  { "test",             algf_test },
+  { "search",           algf_search },
+  { "find_all",         algf_find_all },
   { "gmatch",           algf_gmatch },
   { "gsub",             algf_gsub },
   { "count",            algf_count },
   { "split",            algf_split },
   { "new",              algf_new },
+  { "cache_stats",      algf_cache_stats },
+  { "cache_clear",      algf_cache_clear },
+  { "cache_config",     algf_cache_config },
   { "flags",            LOnig_get_flags },
   { "version",          LOnig_version },
   { "setdefaultsyntax", LOnig_setdefaultsyntax },
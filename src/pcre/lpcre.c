@@ -2,9 +2,11 @@
 /* See Copyright Notice in the file LICENSE */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <locale.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdint.h>
 #include <pcre.h>
 
@@ -12,6 +14,12 @@
 #include "lauxlib.h"
 #include "../common.h"
 
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#endif
+
 extern int Lpcre_get_flags (lua_State *L);
 extern int Lpcre_config (lua_State *L);
 extern flag_pair pcre_error_flags[];
@@ -37,12 +45,15 @@ static int getcflags (lua_State *L, int pos);
 static void checkarg_compile (lua_State *L, int pos, TArgComp *argC);
 #define ALG_GETCARGS(a,b,c)  checkarg_compile(a,b,c)
 
+static int cache_pushlarg (lua_State *L, const TArgComp *argC);
+#define ALG_CACHE_PUSHLARG(L,argC)  cache_pushlarg(L,argC)
+
 #define ALG_NOMATCH(res)   ((res) == PCRE_ERROR_NOMATCH)
 #define ALG_ISMATCH(res)   ((res) >= 0)
-#define ALG_SUBBEG(ud,n)   ud->match[n+n]
-#define ALG_SUBEND(ud,n)   ud->match[n+n+1]
+#define ALG_SUBBEG(ud,n)   ((ud)->shift + (ud)->match[n+n])
+#define ALG_SUBEND(ud,n)   ((ud)->shift + (ud)->match[n+n+1])
 #define ALG_SUBLEN(ud,n)   (ALG_SUBEND(ud,n) - ALG_SUBBEG(ud,n))
-#define ALG_SUBVALID(ud,n) (ALG_SUBBEG(ud,n) >= 0)
+#define ALG_SUBVALID(ud,n) ((ud)->match[n+n] >= 0)
 #define ALG_NSUB(ud)       ((int)ud->ncapt)
 
 #define ALG_PUSHSUB(L,ud,text,n) \
@@ -58,28 +69,70 @@ static void checkarg_compile (lua_State *L, int pos, TArgComp *argC);
 
 #define ALG_BASE(st)  0
 #define ALG_PULL
+#define ALG_CHARLEN(ud,text,len,pos) \
+  ((ud)->utf ? utf8_charlen (text, len, pos) : 1)
 
 typedef struct {
   pcre       * pr;
   pcre_extra * extra;
   int        * match;
+  size_t       shift;              /* offset of the window the match was found in */
   int          ncapt;
   const unsigned char * tables;
   int          freed;
+  int          utf;                /* compiled in UTF-8 mode */
+  int        * dfa_buf;            /* kept between the calls of dfa_exec */
+  size_t       dfa_bufsize;
+  TLiteral     lit;                /* the pattern if it is a literal string */
+  int          names;              /* names table (registry reference), or 0 */
 } TPcre;
 
 #define TUserdata TPcre
 
+static int test_exec (TPcre *ud, TArgExec *argE);
+#define ALG_TEST_EXEC(ud,argE) test_exec (ud, argE)
+
+/* Flags with which a pattern is not searched for as a literal string */
+#define LITERAL_CFLAGS_OFF (PCRE_EXTENDED | PCRE_UTF8 | PCRE_ANCHORED | \
+                            LITERAL_CF_AUTO_CALLOUT | LITERAL_CF_FIRSTLINE)
+#define LITERAL_EFLAGS_OFF (PCRE_ANCHORED | LITERAL_EF_PARTIAL | LITERAL_EF_PARTIAL_HARD)
+#ifdef PCRE_AUTO_CALLOUT
+#  define LITERAL_CF_AUTO_CALLOUT PCRE_AUTO_CALLOUT
+#else
+#  define LITERAL_CF_AUTO_CALLOUT 0
+#endif
+#ifdef PCRE_FIRSTLINE
+#  define LITERAL_CF_FIRSTLINE PCRE_FIRSTLINE
+#else
+#  define LITERAL_CF_FIRSTLINE 0
+#endif
+#ifdef PCRE_PARTIAL
+#  define LITERAL_EF_PARTIAL PCRE_PARTIAL
+#else
+#  define LITERAL_EF_PARTIAL 0
+#endif
+#ifdef PCRE_PARTIAL_HARD
+#  define LITERAL_EF_PARTIAL_HARD PCRE_PARTIAL_HARD
+#else
+#  define LITERAL_EF_PARTIAL_HARD 0
+#endif
+
 #if PCRE_MAJOR >= 4
-static void do_named_subpatterns (lua_State *L, TPcre *ud, const char *text);
-#  define DO_NAMED_SUBPATTERNS do_named_subpatterns
+#  define ALG_NAMES(ud) ((ud)->names)
+
+static size_t cache_sizeof (TPcre *ud);
+#define ALG_CACHE_SIZEOF(ud)  cache_sizeof(ud)
 #endif
 
+static void prepare_subject (TPcre *ud, TArgExec *argE);
+#define ALG_PREPARE_SUBJECT(L,ud,argE,pos)  prepare_subject(ud,argE)
+
 #include "../algo.h"
 
 /* Locations of the 2 permanent tables in the function environment */
 #define INDEX_CHARTABLES_META  1      /* chartables type's metatable */
 #define INDEX_CHARTABLES_LINK  2      /* link chartables to compiled regex */
+#define INDEX_LIMITS           3      /* TMatchLimits userdata (defaults) */
 
 static const char chartables_typename[] = "chartables";
 
@@ -122,7 +175,7 @@ static int generate_error (lua_State *L, const TPcre *ud, int errcode) {
 }
 
 #if PCRE_MAJOR >= 6
-/* method r:dfa_exec (s, [st], [ef], [ovecsize], [wscount]) */
+/* method r:dfa_exec (s, [st], [ef], [ovecsize], [wscount], [out]) */
 static void checkarg_dfa_exec (lua_State *L, TArgExec *argE, TPcre **ud) {
   *ud = check_ud (L);
   argE->text = luaL_checklstring (L, 2, &argE->textlen);
@@ -178,6 +231,10 @@ static int chartables_tostring (lua_State *L) {
 static void checkarg_compile (lua_State *L, int pos, TArgComp *argC) {
   argC->locale = NULL;
   argC->tables = NULL;
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_LIMITS);
+  argC->limits = *(const TMatchLimits*) lua_touserdata (L, -1);
+  lua_pop (L, 1);
+  get_match_limits (L, pos + 1, &argC->limits);
   if (!lua_isnoneornil (L, pos)) {
     if (lua_isstring (L, pos))
       argC->locale = lua_tostring (L, pos);
@@ -188,6 +245,104 @@ static void checkarg_compile (lua_State *L, int pos, TArgComp *argC) {
   }
 }
 
+/* pushes the library-specific part of the compiled-pattern cache key */
+static int cache_pushlarg (lua_State *L, const TArgComp *argC) {
+  char limits[40];
+  sprintf (limits, "%lu,%lu", argC->limits.match, argC->limits.depth);
+  if (argC->locale)
+    lua_pushfstring (L, "%sL%s", limits, argC->locale);
+  else if (argC->tables)
+    lua_pushfstring (L, "%sT%p", limits, (const void*)argC->tables);
+  else
+    lua_pushstring (L, limits);
+  return 1;
+}
+
+static size_t cache_sizeof (TPcre *ud) {
+  size_t size = 0;
+  pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_SIZE, &size);
+  return sizeof (TPcre) + size;
+}
+
+/* Lock serializing the uses of the process-wide table cache of common.c */
+#ifdef _WIN32
+static SRWLOCK global_lock = SRWLOCK_INIT;
+#  define GLOBAL_LOCK()    AcquireSRWLockExclusive (&global_lock)
+#  define GLOBAL_UNLOCK()  ReleaseSRWLockExclusive (&global_lock)
+#else
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define GLOBAL_LOCK()    pthread_mutex_lock (&global_lock)
+#  define GLOBAL_UNLOCK()  pthread_mutex_unlock (&global_lock)
+#endif
+
+/* the character tables of a locale, from the cache in common.c */
+static const unsigned char *tables_acquire (const char *locale,
+                                            const char **errmsg) {
+  const unsigned char *tables;
+  GLOBAL_LOCK ();
+  tables = locale_tables_acquire (locale, pcre_maketables, errmsg);
+  GLOBAL_UNLOCK ();
+  return tables;
+}
+
+static void tables_release (const unsigned char *tables) {
+  int unused;
+  GLOBAL_LOCK ();
+  unused = locale_tables_release (tables);
+  GLOBAL_UNLOCK ();
+  if (unused)
+    pcre_free ((void *)tables);
+}
+
+/* the heap limit of PCRE2 has no counterpart in PCRE */
+static void set_match_limits (lua_State *L, TPcre *ud, const TMatchLimits *lim) {
+#ifdef PCRE_EXTRA_MATCH_LIMIT
+  if (lim->match == 0 && lim->depth == 0)
+    return;
+  if (ud->extra == NULL) {         /* pcre_study had nothing to return */
+    ud->extra = (pcre_extra*) pcre_malloc (sizeof (pcre_extra));
+    if (ud->extra == NULL)
+      luaL_error (L, "malloc failed");
+    memset (ud->extra, 0, sizeof (pcre_extra));
+  }
+  if (lim->match) {
+    ud->extra->flags |= PCRE_EXTRA_MATCH_LIMIT;
+    ud->extra->match_limit = lim->match;
+  }
+#ifdef PCRE_EXTRA_MATCH_LIMIT_RECURSION
+  if (lim->depth) {
+    ud->extra->flags |= PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+    ud->extra->match_limit_recursion = lim->depth;
+  }
+#endif
+#else
+  (void) L; (void) ud; (void) lim;
+#endif
+}
+
+#if PCRE_MAJOR >= 4
+/* makes the names table of the regex (see names_add) */
+static void make_names (lua_State *L, TPcre *ud) {
+  int i, namecount, name_entry_size;
+  unsigned char *tabptr;
+
+  pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_NAMECOUNT, &namecount);
+  if (namecount <= 0)
+    return;
+  pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_NAMETABLE, &tabptr);
+  pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_NAMEENTRYSIZE, &name_entry_size);
+  lua_createtable (L, 2 * namecount, namecount);
+  for (i = 0; i < namecount; i++) {
+    int n = (tabptr[0] << 8) | tabptr[1]; /* number of the capturing parenthesis */
+    if (n > 0 && n <= ALG_NSUB(ud))     /* check range */
+      names_add (L, (char *)tabptr + 2, strlen ((char *)tabptr + 2), n);
+    tabptr += name_entry_size;
+  }
+  ud->names = names_ref (L);
+}
+#endif /* #if PCRE_MAJOR >= 4 */
+
+
 static int compile_regex (lua_State *L, const TArgComp *argC, TPcre **pud) {
   const char *error;
   int erroffset;
@@ -200,12 +355,9 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TPcre **pud) {
   lua_setmetatable (L, -2);
 
   if (argC->locale) {
-    char old_locale[256];
-    strcpy (old_locale, setlocale (LC_CTYPE, NULL));  /* store the locale */
-    if (NULL == setlocale (LC_CTYPE, argC->locale))   /* set new locale */
-      return luaL_error (L, "cannot set locale");
-    ud->tables = tables = pcre_maketables ();  /* make tables with new locale */
-    setlocale (LC_CTYPE, old_locale);          /* restore the old locale */
+    const char *errmsg = NULL;
+    if ((ud->tables = tables = tables_acquire (argC->locale, &errmsg)) == NULL)
+      return luaL_error (L, "%s", errmsg);
   }
   else if (argC->tables) {
     tables = argC->tables;
@@ -223,108 +375,257 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TPcre **pud) {
 
   ud->extra = pcre_study (ud->pr, 0, &error);
   if (error) return luaL_error (L, "%s", error);
+  set_match_limits (L, ud, &argC->limits);
 
   pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_CAPTURECOUNT, &ud->ncapt);
+  {
+    unsigned long int options = 0;
+    pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_OPTIONS, &options);
+    ud->utf = (options & PCRE_UTF8) != 0;
+  }
   /* need (2 ints per capture, plus one for substring match) * 3/2 */
   ud->match = (int *) Lmalloc (L, (ALG_NSUB(ud) + 1) * 3 * sizeof (int));
   if (!ud->match)
     luaL_error (L, "malloc failed");
 
+  if (!ud->utf && !(argC->cflags & LITERAL_CFLAGS_OFF)) {
+    literal_extract (L, &ud->lit, argC->pattern, strlen (argC->pattern), LIT_PCRE);
+    if (!ud->lit.whole)
+      literal_free (L, &ud->lit);
+    else if (argC->cflags & PCRE_CASELESS)
+      literal_fold (L, &ud->lit, tables);  /* lcc is the first table */
+  }
+#if PCRE_MAJOR >= 4
+  make_names (L, ud);
+#endif
+
   if (pud) *pud = ud;
   return 1;
 }
 
-#if PCRE_MAJOR >= 4
-/* the target table must be on lua stack top */
-static void do_named_subpatterns (lua_State *L, TPcre *ud, const char *text) {
-  int i, namecount, name_entry_size;
-  unsigned char *name_table, *tabptr;
+/* validates a UTF-8 subject once for all the matches made on it */
+static void prepare_subject (TPcre *ud, TArgExec *argE) {
+  if (ud->utf && !(argE->eflags & PCRE_NO_UTF8_CHECK) &&
+      utf8_valid (argE->text, argE->textlen))
+    argE->eflags |= PCRE_NO_UTF8_CHECK;
+}
 
-  /* do named subpatterns - NJG */
-  pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_NAMECOUNT, &namecount);
-  if (namecount <= 0)
-    return;
-  pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_NAMETABLE, &name_table);
-  pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_NAMEENTRYSIZE, &name_entry_size);
-  tabptr = name_table;
-  for (i = 0; i < namecount; i++) {
-    int n = (tabptr[0] << 8) | tabptr[1]; /* number of the capturing parenthesis */
-    if (n > 0 && n <= ALG_NSUB(ud)) {   /* check range */
-      lua_pushstring (L, (char *)tabptr + 2); /* name of the capture, zero terminated */
-      ALG_PUSHSUB_OR_FALSE (L, ud, text, n);
-      lua_rawset (L, -3);
+/* a validated subject is still checked when the offset is inside a character */
+static int exec_flags (TPcre *ud, TArgExec *argE, size_t offset) {
+  if (ud->utf && (argE->eflags & PCRE_NO_UTF8_CHECK) && offset < argE->textlen &&
+      (argE->text[offset] & 0xC0) == 0x80)
+    return argE->eflags & ~PCRE_NO_UTF8_CHECK;
+  return argE->eflags;
+}
+
+/* Searches text[0..len) from offset, storing the offsets of the match in
+   ud->match unless it is a mere test. A pattern that is a literal string is
+   just searched for. */
+static int exec1 (TPcre *ud, const char *text, size_t len, int offset,
+                  int eflags, int test) {
+  if (ud->lit.whole && !(eflags & LITERAL_EFLAGS_OFF)) {
+    ptrdiff_t pos = literal_find (&ud->lit, text + offset, len - offset);
+    if (pos < 0)
+      return PCRE_ERROR_NOMATCH;
+    if (test)
+      return 0;
+    ud->match[0] = offset + (int)pos;
+    ud->match[1] = offset + (int)pos + (int)ud->lit.len;
+    return 1;
+  }
+  return pcre_exec (ud->pr, ud->extra, text, (int)len, offset, eflags,
+    test ? NULL : ud->match, test ? 0 : (ALG_NSUB(ud) + 1) * 3);
+}
+
+/* The same for a subject of any length: one whose offsets could overflow an
+   int is searched one window at a time, and the offsets of the match are
+   relative to ud->shift. A match that may go on past the window is searched
+   for again in a window starting where it does. */
+static int match_at (TPcre *ud, TArgExec *argE, size_t offset, int test) {
+  size_t so;
+  int res;
+  ud->shift = 0;
+  if (argE->textlen <= REX_WINDOW)
+    return exec1 (ud, argE->text, argE->textlen, (int)offset,
+                  exec_flags (ud, argE, offset), test);
+  for (;;) {
+    int eflags = exec_flags (ud, argE, offset);
+    size_t len;
+    int clamped;
+    so = offset > REX_WINDOW_MARGIN ? offset - REX_WINDOW_MARGIN : 0;
+    if (ud->utf)              /* a window starts and ends between characters */
+      while (so > 0 && (argE->text[so] & 0xC0) == 0x80)
+        --so;
+    len = argE->textlen - so;
+    clamped = len > REX_WINDOW;
+    if (clamped) {
+      len = REX_WINDOW;
+      if (ud->utf)
+        while ((argE->text[so + len] & 0xC0) == 0x80)
+          --len;
     }
-    tabptr += name_entry_size;
+    res = exec1 (ud, argE->text + so, len, (int)(offset - so),
+      eflags | (so > 0 ? PCRE_NOTBOL : 0) | (clamped ? PCRE_NOTEOL : 0), test);
+    if (!clamped)
+      break;
+    if (res == PCRE_ERROR_NOMATCH)
+      offset = so + len - REX_WINDOW_OVERLAP;
+    else if (res >= 0 && !test && (size_t)ud->match[0] > offset - so &&
+             (size_t)ud->match[1] > len - REX_WINDOW_OVERLAP)
+      offset = so + ud->match[0];
+    else
+      break;
   }
+  ud->shift = so;
+  return res;
+}
+
+static int match (TPcre *ud, TArgExec *argE, size_t offset) {
+  return match_at (ud, argE, offset, 0);
+}
+
+static int gmatch_exec (TUserdata *ud, TArgExec *argE) {
+  return match (ud, argE, argE->startoffset);
+}
+
+static void gmatch_pushsubject (lua_State *L, TArgExec *argE, int pos) {
+  (void)argE;
+  lua_pushvalue (L, pos);
+}
+
+static int findmatch_exec (TPcre *ud, TArgExec *argE) {
+  return match (ud, argE, argE->startoffset);
+}
+
+/* no ovector: pcre_exec returns 0 on a match and records no groups */
+static int test_exec (TPcre *ud, TArgExec *argE) {
+  return match_at (ud, argE, argE->startoffset, 1);
+}
+
+static int gsub_exec (TPcre *ud, TArgExec *argE, size_t st) {
+  return match (ud, argE, st);
+}
+
+static int split_exec (TPcre *ud, TArgExec *argE, size_t offset) {
+  return match (ud, argE, offset);
 }
-#endif /* #if PCRE_MAJOR >= 4 */
 
 #if PCRE_MAJOR >= 6
+/* Runs pcre_dfa_exec with the buffer (ovector followed by the workspace) of
+   the regex object, which is made on first use and grown on demand. */
+static int dfa_match (lua_State *L, TPcre *ud, TArgExec *argE) {
+  size_t bufsize = (argE->ovecsize + argE->wscount) * sizeof (int);
+  if (ud->dfa_bufsize < bufsize) {
+    int *buf = (int*) Lmalloc (L, bufsize);
+    if (!buf)
+      return luaL_error (L, "malloc failed");
+    if (ud->dfa_buf)
+      Lfree (L, ud->dfa_buf, ud->dfa_bufsize);
+    ud->dfa_buf = buf;
+    ud->dfa_bufsize = bufsize;
+  }
+  if (argE->textlen > INT_MAX)  /* the matches of a DFA are not windowed */
+    return luaL_error (L, "subject is too long");
+  return pcre_dfa_exec (ud->pr, ud->extra, argE->text, (int)argE->textlen,
+    (int)argE->startoffset, exec_flags (ud, argE, argE->startoffset), ud->dfa_buf,
+    argE->ovecsize, ud->dfa_buf + argE->ovecsize, argE->wscount);
+}
+
 static int Lpcre_dfa_exec (lua_State *L)
 {
   TArgExec argE;
   TPcre *ud;
-  int res;
-  int *buf, *ovector, *wspace;
-  size_t bufsize;
+  int res, outpos;
 
   checkarg_dfa_exec (L, &argE, &ud);
-  bufsize = (argE.ovecsize + argE.wscount) * sizeof(int);
-  buf = (int*) Lmalloc (L, bufsize);
-  if (!buf)
-    luaL_error (L, "malloc failed");
-  ovector = buf;
-  wspace = buf + argE.ovecsize;
-
-  res = pcre_dfa_exec (ud->pr, ud->extra, argE.text, (int)argE.textlen,
-    argE.startoffset, argE.eflags, ovector, argE.ovecsize, wspace, argE.wscount);
+  outpos = OptResultTable (L, 7);
+  res = dfa_match (L, ud, &argE);
 
   if (ALG_ISMATCH (res) || res == PCRE_ERROR_PARTIAL) {
     int i;
     int max = (res>0) ? res : (res==0) ? (int)argE.ovecsize/2 : 1;
+    int *ovector = ud->dfa_buf;
     lua_pushinteger (L, ovector[0] + 1);         /* 1-st return value */
-    lua_newtable (L);                            /* 2-nd return value */
+    push_result_table (L, outpos, max);          /* 2-nd return value */
     for (i=0; i<max; i++) {
       lua_pushinteger (L, ovector[i+i+1]);
       lua_rawseti (L, -2, i+1);
     }
     lua_pushinteger (L, res);                    /* 3-rd return value */
-    Lfree (L, buf, bufsize);
     return 3;
   }
   else {
-    Lfree (L, buf, bufsize);
     if (ALG_NOMATCH (res))
       return lua_pushnil (L), 1;
     else
       return generate_error (L, ud, res);
   }
 }
-#endif /* #if PCRE_MAJOR >= 6 */
-
-static int gmatch_exec (TUserdata *ud, TArgExec *argE) {
-  return pcre_exec (ud->pr, ud->extra, argE->text, argE->textlen,
-    argE->startoffset, argE->eflags, ud->match, (ALG_NSUB(ud) + 1) * 3);
-}
-
-static void gmatch_pushsubject (lua_State *L, TArgExec *argE) {
-  lua_pushlstring (L, argE->text, argE->textlen);
-}
-
-static int findmatch_exec (TPcre *ud, TArgExec *argE) {
-  return pcre_exec (ud->pr, ud->extra, argE->text, argE->textlen,
-    argE->startoffset, argE->eflags, ud->match, (ALG_NSUB(ud) + 1) * 3);
-}
 
-static int gsub_exec (TPcre *ud, TArgExec *argE, int st) {
-  return pcre_exec (ud->pr, ud->extra, argE->text, argE->textlen,
-    st, argE->eflags, ud->match, (ALG_NSUB(ud) + 1) * 3);
+static int dfa_gmatch_iter (lua_State *L) {
+  int last_end, res;
+  TArgExec argE;
+  TPcre *ud        = (TPcre*) lua_touserdata (L, lua_upvalueindex (1));
+  check_subject (L, lua_upvalueindex (2), &argE); /* re-fetch: buffers may move */
+  argE.eflags      = lua_tointeger (L, lua_upvalueindex (3));
+  argE.ovecsize    = lua_tointeger (L, lua_upvalueindex (4));
+  argE.wscount     = lua_tointeger (L, lua_upvalueindex (5));
+  argE.startoffset = (size_t)lua_tointeger (L, lua_upvalueindex (6));
+  last_end         = (int)lua_tointeger (L, lua_upvalueindex (7));
+
+  while (1) {
+    if (argE.startoffset > argE.textlen)
+      return 0;
+    res = dfa_match (L, ud, &argE);
+    if (ALG_ISMATCH (res)) {
+      int from = ud->dfa_buf[0], to = ud->dfa_buf[1];     /* the longest match */
+      int incr = 0;
+      if (from == to) { /* no progress: prevent endless loop */
+        if (last_end == to) {
+          argE.startoffset += ALG_CHARLEN (ud, argE.text, argE.textlen,
+                                           argE.startoffset);
+          continue;
+        }
+        incr = (int) ALG_CHARLEN (ud, argE.text, argE.textlen, to);
+      }
+      lua_pushinteger (L, to + incr); /* update start offset */
+      lua_replace (L, lua_upvalueindex (6));
+      lua_pushinteger (L, to);        /* update last end of match */
+      lua_replace (L, lua_upvalueindex (7));
+      lua_pushlstring (L, argE.text + from, to - from);
+      return 1;
+    }
+    else if (ALG_NOMATCH (res))
+      return 0;
+    else
+      return generate_error (L, ud, res);
+  }
 }
 
-static int split_exec (TPcre *ud, TArgExec *argE, int offset) {
-  return pcre_exec (ud->pr, ud->extra, argE->text, argE->textlen, offset,
-                    argE->eflags, ud->match, (ALG_NSUB(ud) + 1) * 3);
+/* method r:dfa_gmatch (s, [ef], [ovecsize], [wscount]) */
+static int Lpcre_dfa_gmatch (lua_State *L) {
+  TArgExec argE;
+  int eflags;
+  TPcre *ud = check_ud (L);
+  check_subject (L, 2, &argE);
+  argE.eflags = (int)luaL_optinteger (L, 3, ALG_EFLAGS_DFLT);
+  argE.ovecsize = (size_t)luaL_optinteger (L, 4, 100);
+  argE.wscount = (size_t)luaL_optinteger (L, 5, 50);
+  eflags = argE.eflags;
+  prepare_subject (ud, &argE);
+  if (lua_type (L, 2) == LUA_TSTRING)   /* a buffer may change between calls */
+    eflags = argE.eflags;
+  lua_pushvalue (L, 1);                          /* 1-st upvalue: ud */
+  lua_pushvalue (L, 2);                          /* 2-nd upvalue: s  */
+  lua_pushinteger (L, eflags);                   /* 3-rd upvalue: ef */
+  lua_pushinteger (L, (lua_Integer)argE.ovecsize);
+  lua_pushinteger (L, (lua_Integer)argE.wscount);
+  lua_pushinteger (L, 0);                        /* 6-th upvalue: startoffset */
+  lua_pushinteger (L, -1);                       /* 7-th upvalue: last end of match */
+  lua_pushcclosure (L, dfa_gmatch_iter, 7);
+  return 1;
 }
+#endif /* #if PCRE_MAJOR >= 6 */
 
 static int Lpcre_gc (lua_State *L) {
   TPcre *ud = check_ud (L);
@@ -332,8 +633,11 @@ static int Lpcre_gc (lua_State *L) {
     ud->freed = 1;
     if (ud->pr)      pcre_free (ud->pr);
     if (ud->extra)   pcre_free (ud->extra);
-    if (ud->tables)  pcre_free ((void *)ud->tables);
+    if (ud->tables)  tables_release (ud->tables);
     Lfree (L, ud->match, (ALG_NSUB(ud) + 1) * 3 * sizeof (int));
+    if (ud->dfa_buf) Lfree (L, ud->dfa_buf, ud->dfa_bufsize);
+    literal_free (L, &ud->lit);
+    if (ud->names) luaL_unref (L, LUA_REGISTRYINDEX, ud->names);
   }
   return 0;
 }
@@ -410,6 +714,14 @@ static int Lpcre_fullinfo (lua_State *L) {
   return 1;
 }
 
+/* function set_default_limits ({ [match_limit=N], [depth_limit=N] }) */
+static int Lpcre_set_default_limits (lua_State *L) {
+  lua_settop (L, 1);
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_LIMITS);
+  set_default_limits (L, 1, (TMatchLimits*) lua_touserdata (L, -1));
+  return 0;
+}
+
 static const luaL_Reg chartables_meta[] = {
   { "__gc",        chartables_gc },
   { "__tostring",  chartables_tostring },
@@ -421,8 +733,16 @@ static const luaL_Reg r_methods[] = {
   { "tfind",       algm_tfind },    /* old name: match */
   { "find",        algm_find },
   { "match",       algm_match },
+  { "test",        algm_test },
+  { "search",      algm_search },
+  { "find_all",    algm_find_all },
+  { "grep",        algm_grep },
+  { "test_batch",  algm_test_batch },
+  { "exec_batch",  algm_exec_batch },
+  { "count_batch", algm_count_batch },
 #if PCRE_MAJOR >= 6
   { "dfa_exec",    Lpcre_dfa_exec },
+  { "dfa_gmatch",  Lpcre_dfa_gmatch },
 #endif
   { "fullinfo",    Lpcre_fullinfo },
   { "__gc",        Lpcre_gc },
@@ -433,17 +753,24 @@ static const luaL_Reg r_methods[] = {
 static const luaL_Reg r_functions[] = {
   { "match",       algf_match },
   { "find",        algf_find },
+  { "test",        algf_test },
+  { "search",      algf_search },
+  { "find_all",    algf_find_all },
   { "gmatch",      algf_gmatch },
   { "gsub",        algf_gsub },
   { "count",       algf_count },
   { "split",       algf_split },
   { "new",         algf_new },
+  { "cache_stats", algf_cache_stats },
+  { "cache_clear", algf_cache_clear },
+  { "cache_config", algf_cache_config },
   { "flags",       Lpcre_get_flags },
   { "version",     Lpcre_version },
   { "maketables",  Lpcre_maketables },
 #if PCRE_MAJOR >= 4
   { "config",      Lpcre_config },
 #endif
+  { "set_default_limits", Lpcre_set_default_limits },
   { NULL, NULL }
 };
 
@@ -481,5 +808,13 @@ REX_API int REX_OPENLIB (lua_State *L) {
   lua_rawseti (L, -3, INDEX_CHARTABLES_LINK);
 #endif
 
+  /* create the default match limits */
+  memset (lua_newuserdata (L, sizeof (TMatchLimits)), 0, sizeof (TMatchLimits));
+#if LUA_VERSION_NUM == 501
+  lua_rawseti (L, LUA_ENVIRONINDEX, INDEX_LIMITS);
+#else
+  lua_rawseti (L, -3, INDEX_LIMITS);
+#endif
+
   return 1;
 }
@@ -1,6 +1,7 @@
 /* lpcre2.c - Lua binding of PCRE2 library */
 /* See Copyright Notice in the file LICENSE */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <locale.h>
@@ -12,6 +13,12 @@
 #include "lauxlib.h"
 #include "../common.h"
 
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#endif
+
 extern int Lpcre2_get_flags (lua_State *L);
 extern int Lpcre2_config (lua_State *L);
 extern flag_pair pcre2_error_flags[];
@@ -37,10 +44,13 @@ static int getcflags (lua_State *L, int pos);
 static void checkarg_compile (lua_State *L, int pos, TArgComp *argC);
 #define ALG_GETCARGS(a,b,c)  checkarg_compile(a,b,c)
 
+static int cache_pushlarg (lua_State *L, const TArgComp *argC);
+#define ALG_CACHE_PUSHLARG(L,argC)  cache_pushlarg(L,argC)
+
 #define ALG_NOMATCH(res)   ((res) == PCRE2_ERROR_NOMATCH)
 #define ALG_ISMATCH(res)   ((res) >= 0)
-#define ALG_SUBBEG(ud,n)   ((int)(ud)->ovector[(n)+(n)])
-#define ALG_SUBEND(ud,n)   ((int)(ud)->ovector[(n)+(n)+1])
+#define ALG_SUBBEG(ud,n)   ((size_t)(ud)->ovector[(n)+(n)])
+#define ALG_SUBEND(ud,n)   ((size_t)(ud)->ovector[(n)+(n)+1])
 #define ALG_SUBLEN(ud,n)   (ALG_SUBEND((ud),(n)) - ALG_SUBBEG((ud),(n)))
 #define ALG_SUBVALID(ud,n) (0 == pcre2_substring_length_bynumber((ud)->match_data, (n), NULL))
 #define ALG_NSUB(ud)       ((int)(ud)->ncapt)
@@ -58,29 +68,111 @@ static void checkarg_compile (lua_State *L, int pos, TArgComp *argC);
 
 #define ALG_BASE(st)  0
 #define ALG_PULL
+#define ALG_CHARLEN(ud,text,len,pos) \
+  ((ud)->utf ? utf8_charlen (text, len, pos) : 1)
+
+typedef struct tagSharedCode TSharedCode;
+
+/* JIT policy of the library */
+enum { JIT_NEVER, JIT_ALWAYS, JIT_ADAPTIVE };
+
+typedef struct {
+  int    mode;
+  size_t threshold;             /* executions or scanned bytes (adaptive mode) */
+} TJitPolicy;
+
+/* JIT stack of the library, shared by its regex objects */
+typedef struct {
+  pcre2_jit_stack *stack;       /* created on first use */
+  size_t startsize, maxsize;
+} TJitStack;
 
 typedef struct {
   pcre2_code *pr;
+  TSharedCode *shared;          /* registry entry owning pr, or NULL */
   pcre2_compile_context *ccontext;
+  pcre2_match_context *mcontext;
   pcre2_match_data *match_data;
   PCRE2_SIZE *ovector;
   int ncapt;
   const unsigned char *tables;
   int freed;
+  int utf;                      /* compiled in UTF mode */
+  const TJitPolicy *jitpolicy;
+  uint32_t jitoptions;          /* JIT modes compiled, 0 if none */
+  int jitfailed;                /* automatic JIT compilation failed */
+  size_t execs, scanned;        /* usage counters for the adaptive JIT */
+  pcre2_match_data *dfa_match_data;  /* kept between the calls of dfa_exec */
+  size_t dfa_pairs;
+  int *dfa_wspace;
+  size_t dfa_wscount;
+  TLiteral lit;                 /* the pattern if it is a literal string */
+  int names;                    /* names table (registry reference), or 0 */
 } TPcre2;
 
 #define TUserdata TPcre2
 
-static void do_named_subpatterns (lua_State *L, TPcre2 *ud, const char *text);
-#  define DO_NAMED_SUBPATTERNS do_named_subpatterns
+/* Flags with which a pattern is not searched for as a literal string */
+#define LITERAL_CFLAGS_OFF (PCRE2_EXTENDED | PCRE2_UTF | PCRE2_UCP | PCRE2_ANCHORED | \
+                            PCRE2_AUTO_CALLOUT | PCRE2_FIRSTLINE | LITERAL_CF_MORE)
+#define LITERAL_EFLAGS_OFF (PCRE2_ANCHORED | PCRE2_PARTIAL_SOFT | PCRE2_PARTIAL_HARD | \
+                            LITERAL_EF_MORE)
+#ifdef PCRE2_ENDANCHORED
+#  define LITERAL_CF_MORE (PCRE2_EXTENDED_MORE | PCRE2_ENDANCHORED)
+#  define LITERAL_EF_MORE PCRE2_ENDANCHORED
+#else
+#  define LITERAL_CF_MORE 0
+#  define LITERAL_EF_MORE 0
+#endif
+
+#define ALG_NAMES(ud) ((ud)->names)
+
+static size_t cache_sizeof (TPcre2 *ud);
+#define ALG_CACHE_SIZEOF(ud)  cache_sizeof(ud)
+
+static void prepare_subject (TPcre2 *ud, TArgExec *argE);
+#define ALG_PREPARE_SUBJECT(L,ud,argE,pos)  prepare_subject(ud,argE)
+
+#ifdef PCRE2_SUBSTITUTE_OVERFLOW_LENGTH
+static int gsub_fast (lua_State *L, TPcre2 *ud, TArgExec *argE, TBuffer *BufRep,
+                      int *nsubst);
+#  define ALG_GSUB_FAST(L,ud,argE,BufRep,nsubst)  gsub_fast(L,ud,argE,BufRep,nsubst)
+#endif
+
+static int test_exec (TPcre2 *ud, TArgExec *argE);
+#define ALG_TEST_EXEC(ud,argE) test_exec (ud, argE)
 
 #include "../algo.h"
 
 /* Locations of the 2 permanent tables in the function environment */
 #define INDEX_CHARTABLES_META  1      /* chartables type's metatable */
 #define INDEX_CHARTABLES_LINK  2      /* link chartables to compiled regex */
+#define INDEX_JIT_POLICY       3      /* TJitPolicy userdata */
+#define INDEX_JIT_STACK        4      /* TJitStack userdata */
+#define INDEX_LIMITS           5      /* TMatchLimits userdata (defaults) */
+#define INDEX_STREAM_META      6      /* stream type's metatable */
+#define INDEX_REGEX_LINK       7      /* link streams and sets to their regexes */
+#define INDEX_SET_META         8      /* set type's metatable */
+
+/* Default JIT policy */
+#ifndef REX_PCRE2_JIT_MODE
+#  define REX_PCRE2_JIT_MODE JIT_NEVER
+#endif
+#ifndef REX_PCRE2_JIT_THRESHOLD
+#  define REX_PCRE2_JIT_THRESHOLD 1000
+#endif
+
+/* Default sizes of the JIT stack */
+#ifndef REX_PCRE2_JIT_STACK_MIN
+#  define REX_PCRE2_JIT_STACK_MIN (32 * 1024)
+#endif
+#ifndef REX_PCRE2_JIT_STACK_MAX
+#  define REX_PCRE2_JIT_STACK_MAX (8 * 1024 * 1024)
+#endif
 
 static const char chartables_typename[] = "chartables";
+static const char stream_typename[] = REX_LIBNAME"_stream";
+static const char set_typename[] = REX_LIBNAME"_set";
 
 /*  Functions
  ******************************************************************************
@@ -131,7 +223,7 @@ static int generate_error (lua_State *L, const TPcre2 *ud, int errcode) {
     return luaL_error (L, "PCRE2 error code %d", errcode);
 }
 
-/* method r:dfa_exec (s, [st], [ef], [ovecsize], [wscount]) */
+/* method r:dfa_exec (s, [st], [ef], [ovecsize], [wscount], [out]) */
 static void checkarg_dfa_exec (lua_State *L, TArgExec *argE, TPcre2 **ud) {
   *ud = check_ud (L);
   argE->text = luaL_checklstring (L, 2, &argE->textlen);
@@ -186,6 +278,10 @@ static int chartables_tostring (lua_State *L) {
 static void checkarg_compile (lua_State *L, int pos, TArgComp *argC) {
   argC->locale = NULL;
   argC->tables = NULL;
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_LIMITS);
+  argC->limits = *(const TMatchLimits*) lua_touserdata (L, -1);
+  lua_pop (L, 1);
+  get_match_limits (L, pos + 1, &argC->limits);
   if (!lua_isnoneornil (L, pos)) {
     if (lua_isstring (L, pos))
       argC->locale = lua_tostring (L, pos);
@@ -196,6 +292,311 @@ static void checkarg_compile (lua_State *L, int pos, TArgComp *argC) {
   }
 }
 
+/* pushes the library-specific part of the compiled-pattern cache key */
+static int cache_pushlarg (lua_State *L, const TArgComp *argC) {
+  char limits[40];
+  sprintf (limits, "%lu,%lu,%lu", argC->limits.match, argC->limits.depth,
+           argC->limits.heap);
+  if (argC->locale)
+    lua_pushfstring (L, "%sL%s", limits, argC->locale);
+  else if (argC->tables)
+    lua_pushfstring (L, "%sT%p", limits, (const void*)argC->tables);
+  else
+    lua_pushstring (L, limits);
+  return 1;
+}
+
+static size_t cache_sizeof (TPcre2 *ud) {
+  size_t size = 0;
+  pcre2_pattern_info (ud->pr, PCRE2_INFO_SIZE, &size);
+  return sizeof (TPcre2) + size;
+}
+
+#define FNV1A_INIT 2166136261u
+
+static uint32_t fnv1a (const void *data, size_t len, uint32_t h) {
+  const unsigned char *p = (const unsigned char*) data;
+  while (len--)
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+/* Lock protecting the process-wide data below */
+#ifdef _WIN32
+static SRWLOCK global_lock = SRWLOCK_INIT;
+#  define GLOBAL_LOCK()    AcquireSRWLockExclusive (&global_lock)
+#  define GLOBAL_UNLOCK()  ReleaseSRWLockExclusive (&global_lock)
+#else
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define GLOBAL_LOCK()    pthread_mutex_lock (&global_lock)
+#  define GLOBAL_UNLOCK()  pthread_mutex_unlock (&global_lock)
+#endif
+
+/* the character tables of a locale, from the cache in common.c */
+static const unsigned char *maketables (void) {
+  return pcre2_maketables (NULL); //### argument NULL
+}
+
+static const unsigned char *tables_acquire (const char *locale,
+                                            const char **errmsg) {
+  const unsigned char *tables;
+  GLOBAL_LOCK ();
+  tables = locale_tables_acquire (locale, maketables, errmsg);
+  GLOBAL_UNLOCK ();
+  return tables;
+}
+
+static void tables_release (const unsigned char *tables) {
+  int unused;
+  GLOBAL_LOCK ();
+  unused = locale_tables_release (tables);
+  GLOBAL_UNLOCK ();
+  if (unused)
+    free ((void *)tables); //### free() should be called only if pcre2_maketables was called with NULL argument
+}
+
+/*  Process-wide registry of compiled patterns
+ ******************************************************************************
+ *  Patterns compiled with the default character tables are shared by all the
+ *  Lua states of the process: a regex object keeps its own match data and
+ *  borrows the compiled code from the registry. A registered code is never
+ *  modified; JIT compilation registers a new entry, keyed additionally by
+ *  the JIT options.
+ *  Define REX_PCRE2_NOSHARE to make every regex object own its code.
+ */
+#ifndef REX_PCRE2_NOSHARE
+
+struct tagSharedCode {
+  TSharedCode *next;            /* next entry in the hash chain */
+  pcre2_code  *code;
+  size_t       refcount;
+  uint32_t     hash;
+  uint32_t     cflags;
+  uint32_t     jitoptions;      /* 0 if not JIT-compiled */
+  size_t       patlen;
+  char         pattern[1];
+};
+
+static TSharedCode **shared_buckets;
+static size_t shared_nbuckets, shared_count;
+
+static uint32_t shared_hash (const char *pattern, size_t patlen, uint32_t cflags,
+                             uint32_t jitoptions) {
+  uint32_t h = fnv1a (pattern, patlen, FNV1A_INIT);
+  h = fnv1a (&cflags, sizeof (cflags), h);
+  return fnv1a (&jitoptions, sizeof (jitoptions), h);
+}
+
+/* the lock must be held */
+static TSharedCode *shared_find (uint32_t hash, const char *pattern, size_t patlen,
+                                 uint32_t cflags, uint32_t jitoptions) {
+  TSharedCode *e;
+  if (shared_nbuckets == 0)
+    return NULL;
+  for (e = shared_buckets[hash % shared_nbuckets]; e; e = e->next) {
+    if (e->hash == hash && e->cflags == cflags && e->jitoptions == jitoptions &&
+        e->patlen == patlen && memcmp (e->pattern, pattern, patlen) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+/* the lock must be held */
+static int shared_grow (void) {
+  size_t i, n = shared_nbuckets ? 2 * shared_nbuckets : 64;
+  TSharedCode **b = (TSharedCode**) calloc (n, sizeof (TSharedCode*));
+  if (!b)
+    return 0;
+  for (i = 0; i < shared_nbuckets; i++) {
+    TSharedCode *e, *next;
+    for (e = shared_buckets[i]; e; e = next) {
+      next = e->next;
+      e->next = b[e->hash % n];
+      b[e->hash % n] = e;
+    }
+  }
+  free (shared_buckets);
+  shared_buckets = b;
+  shared_nbuckets = n;
+  return 1;
+}
+
+/* Returns a referenced entry, or NULL if the pattern is not registered. */
+static TSharedCode *shared_lookup (const char *pattern, size_t patlen, uint32_t cflags,
+                                   uint32_t jitoptions) {
+  TSharedCode *e;
+  uint32_t hash = shared_hash (pattern, patlen, cflags, jitoptions);
+  GLOBAL_LOCK ();
+  if ((e = shared_find (hash, pattern, patlen, cflags, jitoptions)) != NULL)
+    e->refcount++;
+  GLOBAL_UNLOCK ();
+  return e;
+}
+
+/* Registers a code compiled by the caller and returns a referenced entry.
+   If an equal entry has been registered meanwhile, the code is freed and that
+   entry is returned. Returns NULL (the code being left to the caller) if
+   memory allocation fails. */
+static TSharedCode *shared_insert (pcre2_code *code, const char *pattern, size_t patlen,
+                                   uint32_t cflags, uint32_t jitoptions) {
+  TSharedCode *e;
+  uint32_t hash = shared_hash (pattern, patlen, cflags, jitoptions);
+  GLOBAL_LOCK ();
+  if ((e = shared_find (hash, pattern, patlen, cflags, jitoptions)) != NULL) {
+    e->refcount++;
+    GLOBAL_UNLOCK ();
+    pcre2_code_free (code);
+    return e;
+  }
+  if ((shared_count >= shared_nbuckets && !shared_grow ()) ||
+      (e = (TSharedCode*) malloc (sizeof (TSharedCode) + patlen)) == NULL) {
+    GLOBAL_UNLOCK ();
+    return NULL;
+  }
+  e->code = code;
+  e->refcount = 1;
+  e->hash = hash;
+  e->cflags = cflags;
+  e->jitoptions = jitoptions;
+  e->patlen = patlen;
+  memcpy (e->pattern, pattern, patlen);
+  e->next = shared_buckets[hash % shared_nbuckets];
+  shared_buckets[hash % shared_nbuckets] = e;
+  ++shared_count;
+  GLOBAL_UNLOCK ();
+  return e;
+}
+
+static void shared_release (TSharedCode *e) {
+  TSharedCode **p;
+  GLOBAL_LOCK ();
+  if (--e->refcount > 0) {
+    GLOBAL_UNLOCK ();
+    return;
+  }
+  for (p = &shared_buckets[e->hash % shared_nbuckets]; *p != e; p = &(*p)->next)
+    ;
+  *p = e->next;
+  --shared_count;
+  GLOBAL_UNLOCK ();
+  pcre2_code_free (e->code);
+  free (e);
+}
+
+/* Makes the regex object borrow a JIT-compiled variant of its shared code. */
+static int shared_jit_compile (TPcre2 *ud, uint32_t options) {
+  TSharedCode *e = ud->shared, *j;
+  options |= e->jitoptions;              /* JIT modes accumulate, as in PCRE2 */
+  if (options == e->jitoptions)
+    return 0;
+  j = shared_lookup (e->pattern, e->patlen, e->cflags, options);
+  if (j == NULL) {
+    int errcode;
+    pcre2_code *code = pcre2_code_copy (e->code);
+    if (code == NULL)
+      return PCRE2_ERROR_NOMEMORY;
+    if ((errcode = pcre2_jit_compile (code, options)) != 0) {
+      pcre2_code_free (code);
+      return errcode;
+    }
+    if ((j = shared_insert (code, e->pattern, e->patlen, e->cflags, options)) == NULL) {
+      pcre2_code_free (code);
+      return PCRE2_ERROR_NOMEMORY;
+    }
+  }
+  ud->shared = j;
+  ud->pr = j->code;
+  shared_release (e);
+  return 0;
+}
+
+#endif /* REX_PCRE2_NOSHARE */
+
+static int jit_compile (TPcre2 *ud, uint32_t options) {
+  int errcode;
+#ifndef REX_PCRE2_NOSHARE
+  if (ud->shared)
+    errcode = shared_jit_compile (ud, options);
+  else
+#endif
+    errcode = pcre2_jit_compile (ud->pr, options);
+  if (errcode == 0)
+    ud->jitoptions |= options;
+  return errcode;
+}
+
+static pcre2_jit_stack *jit_stack_callback (void *data) {
+  TJitStack *js = (TJitStack*) data;
+  if (js->stack == NULL)
+    js->stack = pcre2_jit_stack_create (js->startsize, js->maxsize, NULL);
+  return js->stack;      /* NULL makes PCRE2 use a small machine stack */
+}
+
+static void set_match_limits (pcre2_match_context *mcontext, const TMatchLimits *lim) {
+  if (lim->match)
+    pcre2_set_match_limit (mcontext, (uint32_t)lim->match);
+#if PCRE2_MAJOR > 10 || PCRE2_MINOR >= 30
+  if (lim->depth)
+    pcre2_set_depth_limit (mcontext, (uint32_t)lim->depth);
+  if (lim->heap)
+    pcre2_set_heap_limit (mcontext, (uint32_t)lim->heap);
+#else
+  if (lim->depth)
+    pcre2_set_recursion_limit (mcontext, (uint32_t)lim->depth);
+#endif
+}
+
+/* makes the names table of the regex (see names_add) */
+static void make_names (lua_State *L, TPcre2 *ud) {
+  uint32_t i, namecount, name_entry_size;
+  PCRE2_SPTR tabptr;
+
+  pcre2_pattern_info (ud->pr, PCRE2_INFO_NAMECOUNT, &namecount);
+  if (namecount == 0)
+    return;
+  pcre2_pattern_info (ud->pr, PCRE2_INFO_NAMETABLE, &tabptr);
+  pcre2_pattern_info (ud->pr, PCRE2_INFO_NAMEENTRYSIZE, &name_entry_size);
+  lua_createtable (L, 2 * namecount, namecount);
+  for (i = 0; i < namecount; i++) {
+    int n = (tabptr[0] << 8) | tabptr[1]; /* number of the capturing parenthesis */
+    if (n > 0 && n <= ALG_NSUB(ud))     /* check range */
+      names_add (L, (const char *)tabptr + 2, strlen ((const char *)tabptr + 2), n);
+    tabptr += name_entry_size;
+  }
+  ud->names = names_ref (L);
+}
+
+/* fills in the capture count and the match data of a compiled regex */
+static void prepare_match (lua_State *L, TPcre2 *ud, const TMatchLimits *lim) {
+  uint32_t options;
+  if (0 != pcre2_pattern_info (ud->pr, PCRE2_INFO_CAPTURECOUNT, &ud->ncapt)) //###
+    luaL_error (L, "could not get pattern info");
+  pcre2_pattern_info (ud->pr, PCRE2_INFO_ALLOPTIONS, &options);
+  ud->utf = (options & PCRE2_UTF) != 0;
+
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_JIT_POLICY);
+  ud->jitpolicy = (const TJitPolicy*) lua_touserdata (L, -1);
+  lua_pop (L, 1);
+  if (ud->jitpolicy->mode == JIT_ALWAYS && jit_compile (ud, PCRE2_JIT_COMPLETE) != 0)
+    ud->jitfailed = 1;
+
+  /* need (2 ints per capture, plus one for substring match) * 3/2 */
+  ud->match_data = pcre2_match_data_create(ud->ncapt+1, NULL); //### CHECK ALL
+  if (!ud->match_data)
+    luaL_error (L, "malloc failed");
+
+  ud->ovector = pcre2_get_ovector_pointer(ud->match_data);
+
+  ud->mcontext = pcre2_match_context_create (NULL);
+  if (!ud->mcontext)
+    luaL_error (L, "malloc failed");
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_JIT_STACK);
+  pcre2_jit_stack_assign (ud->mcontext, jit_stack_callback, lua_touserdata (L, -1));
+  lua_pop (L, 1);
+  set_match_limits (ud->mcontext, lim);
+  make_names (L, ud);
+}
+
 static int compile_regex (lua_State *L, const TArgComp *argC, TPcre2 **pud) {
   int errcode;
   PCRE2_SIZE erroffset;
@@ -211,13 +612,10 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TPcre2 **pud) {
     return luaL_error (L, "malloc failed");
 
   if (argC->locale) {
-    char old_locale[256];
-    strcpy (old_locale, setlocale (LC_CTYPE, NULL));  /* store the locale */
-    if (NULL == setlocale (LC_CTYPE, argC->locale))   /* set new locale */
-      return luaL_error (L, "cannot set locale");
-    ud->tables = pcre2_maketables (NULL); /* make tables with new locale */ //### argument NULL
+    const char *errmsg = NULL;
+    if ((ud->tables = tables_acquire (argC->locale, &errmsg)) == NULL)
+      return luaL_error (L, "%s", errmsg);
     pcre2_set_character_tables(ud->ccontext, ud->tables);
-    setlocale (LC_CTYPE, old_locale);          /* restore the old locale */
   }
   else if (argC->tables) {
     pcre2_set_character_tables(ud->ccontext, argC->tables);
@@ -229,91 +627,254 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TPcre2 **pud) {
     lua_pop (L, 1);
   }
 
-  ud->pr = pcre2_compile ((PCRE2_SPTR)argC->pattern, argC->patlen, argC->cflags, &errcode,
-                          &erroffset, ud->ccontext); //### DOUBLE-CHECK ALL ARGUMENTS
-  if (!ud->pr) {
-    if (push_error_message(L, errcode))
-      return luaL_error (L, "%s (pattern offset: %d)", lua_tostring(L,-1), erroffset + 1);
-    else
-      return luaL_error (L, "%s (pattern offset: %d)", "pattern compile error", erroffset + 1);
+#ifndef REX_PCRE2_NOSHARE
+  if (!argC->locale && !argC->tables &&
+      (ud->shared = shared_lookup (argC->pattern, argC->patlen, argC->cflags, 0)) != NULL)
+    ud->pr = ud->shared->code;
+  else
+#endif
+  {
+    ud->pr = pcre2_compile ((PCRE2_SPTR)argC->pattern, argC->patlen, argC->cflags, &errcode,
+                            &erroffset, ud->ccontext); //### DOUBLE-CHECK ALL ARGUMENTS
+    if (!ud->pr) {
+      if (push_error_message(L, errcode))
+        return luaL_error (L, "%s (pattern offset: %d)", lua_tostring(L,-1), erroffset + 1);
+      else
+        return luaL_error (L, "%s (pattern offset: %d)", "pattern compile error", erroffset + 1);
+    }
+#ifndef REX_PCRE2_NOSHARE
+    if (!argC->locale && !argC->tables &&
+        (ud->shared = shared_insert (ud->pr, argC->pattern, argC->patlen, argC->cflags, 0)) != NULL)
+      ud->pr = ud->shared->code;
+#endif
   }
 
-  if (0 != pcre2_pattern_info (ud->pr, PCRE2_INFO_CAPTURECOUNT, &ud->ncapt)) //###
-    return luaL_error (L, "could not get pattern info");
-
-  /* need (2 ints per capture, plus one for substring match) * 3/2 */
-  ud->match_data = pcre2_match_data_create(ud->ncapt+1, NULL); //### CHECK ALL
-  if (!ud->match_data)
-    return luaL_error (L, "malloc failed");
+  prepare_match (L, ud, &argC->limits);
 
-  ud->ovector = pcre2_get_ovector_pointer(ud->match_data);
+  if (!ud->utf && !(argC->cflags & LITERAL_CFLAGS_OFF)) {
+    int syntax = LIT_PCRE;
+#ifdef PCRE2_LITERAL
+    if (argC->cflags & PCRE2_LITERAL)
+      syntax = LIT_WHOLE;
+#endif
+    literal_extract (L, &ud->lit, argC->pattern, argC->patlen, syntax);
+    if (!ud->lit.whole)
+      literal_free (L, &ud->lit);
+    else if (argC->cflags & PCRE2_CASELESS)  /* lcc is the first table */
+      literal_fold (L, &ud->lit, ud->tables ? ud->tables : argC->tables);
+  }
 
   if (pud) *pud = ud;
   return 1;
 }
 
-/* the target table must be on lua stack top */
-static void do_named_subpatterns (lua_State *L, TPcre2 *ud, const char *text) {
-  int i, namecount, name_entry_size;
-  unsigned char *name_table;
-  PCRE2_SPTR tabptr;
+/* Execution flags, with which pcre2_jit_match may be used */
+#define JIT_MATCH_FLAGS (PCRE2_NOTBOL | PCRE2_NOTEOL | PCRE2_NOTEMPTY | \
+                         PCRE2_NOTEMPTY_ATSTART | PCRE2_NO_UTF_CHECK)
+
+/* counts an execution for the automatic JIT policy */
+static void jit_account (TPcre2 *ud, size_t scanned) {
+  if (!(ud->jitoptions & PCRE2_JIT_COMPLETE) && !ud->jitfailed &&
+      ud->jitpolicy->mode != JIT_NEVER) {
+    ++ud->execs;
+    ud->scanned += scanned;
+    if (ud->jitpolicy->mode == JIT_ALWAYS || ud->execs >= ud->jitpolicy->threshold ||
+        ud->scanned >= ud->jitpolicy->threshold) {
+      if (jit_compile (ud, PCRE2_JIT_COMPLETE) != 0)
+        ud->jitfailed = 1;
+    }
+  }
+}
 
-  /* do named subpatterns - NJG */
-  pcre2_pattern_info (ud->pr, PCRE2_INFO_NAMECOUNT, &namecount);
-  if (namecount <= 0)
-    return;
-  pcre2_pattern_info (ud->pr, PCRE2_INFO_NAMETABLE, &name_table);
-  pcre2_pattern_info (ud->pr, PCRE2_INFO_NAMEENTRYSIZE, &name_entry_size);
-  tabptr = name_table;
-  for (i = 0; i < namecount; i++) {
-    int n = (tabptr[0] << 8) | tabptr[1]; /* number of the capturing parenthesis */
-    if (n > 0 && n <= ALG_NSUB(ud)) {   /* check range */
-      lua_pushstring (L, (char *)tabptr + 2); /* name of the capture, zero terminated */
-      ALG_PUSHSUB_OR_FALSE (L, ud, text, n);
-      lua_rawset (L, -3);
+/* a validated subject is still checked when the offset is inside a character */
+static uint32_t exec_flags (TPcre2 *ud, TArgExec *argE, size_t offset) {
+  uint32_t eflags = (uint32_t)argE->eflags;
+  if (ud->utf && (eflags & PCRE2_NO_UTF_CHECK) && offset < argE->textlen &&
+      (argE->text[offset] & 0xC0) == 0x80)
+    eflags &= ~PCRE2_NO_UTF_CHECK;
+  return eflags;
+}
+
+/* A pattern that is a literal string is searched for, and then matched anchored
+   at the found position, which fills the match data. */
+/* test: only whether there is a match matters, so a literal found needs no
+   confirming match to fill the ovector */
+static int exec_match (TPcre2 *ud, TArgExec *argE, size_t offset, int test) {
+  uint32_t eflags = exec_flags (ud, argE, offset);
+  jit_account (ud, argE->textlen - offset);
+  if (ud->lit.whole && !(eflags & LITERAL_EFLAGS_OFF)) {
+    ptrdiff_t pos = literal_find (&ud->lit, argE->text + offset, argE->textlen - offset);
+    if (pos < 0)
+      return PCRE2_ERROR_NOMATCH;
+    if (test)
+      return 1;
+    return pcre2_match (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen,
+      offset + (size_t)pos, eflags | PCRE2_ANCHORED, ud->match_data, ud->mcontext);
+  }
+  /* pcre2_jit_match skips the sanity checks, so use it only when they are not needed */
+  if ((ud->jitoptions & PCRE2_JIT_COMPLETE) && (eflags & ~JIT_MATCH_FLAGS) == 0 &&
+      (!ud->utf || (eflags & PCRE2_NO_UTF_CHECK)))
+    return pcre2_jit_match (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen,
+      offset, eflags, ud->match_data, ud->mcontext);
+  return pcre2_match (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen,
+    offset, eflags, ud->match_data, ud->mcontext); //###
+}
+
+static int match (TPcre2 *ud, TArgExec *argE, size_t offset) {
+  return exec_match (ud, argE, offset, 0);
+}
+
+static int test_exec (TPcre2 *ud, TArgExec *argE) {
+  return exec_match (ud, argE, argE->startoffset, 1);
+}
+
+/* validates a UTF subject once for all the matches made on it */
+static void prepare_subject (TPcre2 *ud, TArgExec *argE) {
+  if (ud->utf && !(argE->eflags & PCRE2_NO_UTF_CHECK) &&
+      utf8_valid (argE->text, argE->textlen))
+    argE->eflags |= PCRE2_NO_UTF_CHECK;
+}
+
+static int gmatch_exec (TUserdata *ud, TArgExec *argE) {
+  return match (ud, argE, argE->startoffset);
+}
+
+static void gmatch_pushsubject (lua_State *L, TArgExec *argE, int pos) {
+  (void)argE;
+  lua_pushvalue (L, pos);
+}
+
+static int findmatch_exec (TPcre2 *ud, TArgExec *argE) {
+  return match (ud, argE, argE->startoffset);
+}
+
+static int gsub_exec (TPcre2 *ud, TArgExec *argE, size_t st) {
+  return match (ud, argE, st);
+}
+
+static int split_exec (TPcre2 *ud, TArgExec *argE, size_t offset) {
+  return match (ud, argE, offset);
+}
+
+#ifdef PCRE2_SUBSTITUTE_OVERFLOW_LENGTH
+/* Execution flags, with which pcre2_substitute may be used */
+#define SUBSTITUTE_FLAGS (PCRE2_NOTBOL | PCRE2_NOTEOL | PCRE2_NO_UTF_CHECK)
+
+/* Makes all the substitutions of gsub with a string template in a single call
+   of pcre2_substitute. Patterns that can match an empty string are left to the
+   generic loop, as it discards an empty match adjacent to the previous match
+   and pcre2_substitute does not. */
+static int gsub_fast (lua_State *L, TPcre2 *ud, TArgExec *argE, TBuffer *BufRep,
+                      int *nsubst) {
+  TBuffer BufTpl;
+  size_t iter = 0, num;
+  const char *str;
+  char *out;
+  PCRE2_SIZE outlen;
+  uint32_t matchempty = 1;
+  int res;
+
+  pcre2_pattern_info (ud->pr, PCRE2_INFO_MATCHEMPTY, &matchempty);
+  if (matchempty || (argE->eflags & ~SUBSTITUTE_FLAGS) != 0 ||
+      (ud->utf && !(argE->eflags & PCRE2_NO_UTF_CHECK)))
+    return 0;
+
+  /* translate the template: "%N" becomes "${N}", "$" becomes "$$" */
+  buffer_init (&BufTpl, 64, L, BufRep->freelist);
+  while (bufferZ_next (BufRep, &iter, &num, &str)) {
+    if (str) {
+      const char *end = str + num, *q;
+      while ((q = (const char*) memchr (str, '$', end - str)) != NULL) {
+        buffer_addlstring (&BufTpl, str, q - str + 1);
+        buffer_addlstring (&BufTpl, "$", 1);
+        str = q + 1;
+      }
+      buffer_addlstring (&BufTpl, str, end - str);
     }
-    tabptr += name_entry_size;
+    else {
+      char ref[32];
+      sprintf (ref, "${%d}", (int)num);
+      buffer_addlstring (&BufTpl, ref, strlen (ref));
+    }
+  }
+  if (ud->utf && !utf8_valid (BufTpl.arr, BufTpl.top))
+    return 0;            /* let the generic loop deal with the template */
+
+  jit_account (ud, argE->textlen);
+  outlen = argE->textlen + argE->textlen / 4 + 64;
+  out = (char*) lua_newuserdata (L, outlen);
+  res = pcre2_substitute (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen, 0,
+    argE->eflags | PCRE2_SUBSTITUTE_GLOBAL | PCRE2_SUBSTITUTE_OVERFLOW_LENGTH |
+    PCRE2_SUBSTITUTE_UNSET_EMPTY, ud->match_data, ud->mcontext,
+    (PCRE2_SPTR)BufTpl.arr, BufTpl.top, (PCRE2_UCHAR*)out, &outlen);
+  if (res == PCRE2_ERROR_NOMEMORY) {        /* outlen is the required size */
+    lua_pop (L, 1);
+    out = (char*) lua_newuserdata (L, outlen);
+    res = pcre2_substitute (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen, 0,
+      argE->eflags | PCRE2_SUBSTITUTE_GLOBAL | PCRE2_SUBSTITUTE_UNSET_EMPTY,
+      ud->match_data, ud->mcontext, (PCRE2_SPTR)BufTpl.arr, BufTpl.top,
+      (PCRE2_UCHAR*)out, &outlen);
   }
+  if (res < 0)
+    return res;
+  lua_pushlstring (L, out, outlen);
+  lua_remove (L, -2);
+  *nsubst = res;
+  return 1;
+}
+#endif
+
+/* Runs pcre2_dfa_match with the workspace and the match data of the regex
+   object, which are made on first use and remade only when the requested
+   sizes change. */
+static int dfa_match (lua_State *L, TPcre2 *ud, TArgExec *argE) {
+  if (ud->dfa_match_data == NULL || ud->dfa_pairs != argE->ovecsize / 2) {
+    if (ud->dfa_match_data)
+      pcre2_match_data_free (ud->dfa_match_data);
+    ud->dfa_match_data = pcre2_match_data_create (argE->ovecsize / 2, NULL);
+    if (!ud->dfa_match_data)
+      return luaL_error (L, "malloc failed");
+    ud->dfa_pairs = argE->ovecsize / 2;
+  }
+  if (ud->dfa_wscount < argE->wscount) {
+    int *wspace = (int*) Lmalloc (L, argE->wscount * sizeof (int));
+    if (!wspace)
+      return luaL_error (L, "malloc failed");
+    if (ud->dfa_wspace)
+      Lfree (L, ud->dfa_wspace, ud->dfa_wscount * sizeof (int));
+    ud->dfa_wspace = wspace;
+    ud->dfa_wscount = argE->wscount;
+  }
+  return pcre2_dfa_match (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen, argE->startoffset,
+    exec_flags (ud, argE, argE->startoffset), ud->dfa_match_data, ud->mcontext,
+    ud->dfa_wspace, argE->wscount);
 }
 
 static int Lpcre2_dfa_exec (lua_State *L)
 {
   TArgExec argE;
   TPcre2 *ud;
-  int res;
-  int *wspace;
-  size_t wsize;
+  int res, outpos;
 
   checkarg_dfa_exec (L, &argE, &ud);
-  wsize = argE.wscount * sizeof(int);
-  wspace = (int*) Lmalloc (L, wsize);
-  if (!wspace)
-    luaL_error (L, "malloc failed");
-
-  ud->match_data = pcre2_match_data_create(argE.ovecsize/2, NULL); //### CHECK ALL
-  if (!ud->match_data)
-    return luaL_error (L, "malloc failed");
-
-  res = pcre2_dfa_match (ud->pr, (PCRE2_SPTR)argE.text, argE.textlen, argE.startoffset,
-    argE.eflags, ud->match_data, NULL, wspace, argE.wscount); //### CHECK ALL
+  outpos = OptResultTable (L, 7);
+  res = dfa_match (L, ud, &argE);
 
   if (ALG_ISMATCH (res) || res == PCRE2_ERROR_PARTIAL) {
     int i;
     int max = (res>0) ? res : (res==0) ? (int)argE.ovecsize/2 : 1;
-    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(ud->match_data);
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(ud->dfa_match_data);
 
     lua_pushinteger (L, ovector[0] + 1);         /* 1-st return value */
-    lua_newtable (L);                            /* 2-nd return value */
+    push_result_table (L, outpos, max);          /* 2-nd return value */
     for (i=0; i<max; i++) {
       lua_pushinteger (L, ovector[i+i+1]);
       lua_rawseti (L, -2, i+1);
     }
     lua_pushinteger (L, res);                    /* 3-rd return value */
-    Lfree (L, wspace, wsize);
     return 3;
   }
   else {
-    Lfree (L, wspace, wsize);
     if (ALG_NOMATCH (res))
       return lua_pushnil (L), 1;
     else
@@ -321,38 +882,633 @@ static int Lpcre2_dfa_exec (lua_State *L)
   }
 }
 
-static int gmatch_exec (TUserdata *ud, TArgExec *argE) {
-  return pcre2_match (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen,
-    argE->startoffset, argE->eflags, ud->match_data, NULL); //###
+static int dfa_gmatch_iter (lua_State *L) {
+  int res;
+  size_t last_end;
+  TArgExec argE;
+  TPcre2 *ud       = (TPcre2*) lua_touserdata (L, lua_upvalueindex (1));
+  check_subject (L, lua_upvalueindex (2), &argE); /* re-fetch: buffers may move */
+  argE.eflags      = (int) lua_tointeger (L, lua_upvalueindex (3));
+  argE.ovecsize    = (size_t) lua_tointeger (L, lua_upvalueindex (4));
+  argE.wscount     = (size_t) lua_tointeger (L, lua_upvalueindex (5));
+  argE.startoffset = (size_t) lua_tointeger (L, lua_upvalueindex (6));
+  last_end         = (size_t) lua_tointeger (L, lua_upvalueindex (7));
+
+  while (1) {
+    if (argE.startoffset > argE.textlen)
+      return 0;
+    res = dfa_match (L, ud, &argE);
+    if (ALG_ISMATCH (res)) {
+      PCRE2_SIZE *ovector = pcre2_get_ovector_pointer (ud->dfa_match_data);
+      size_t from = ovector[0], to = ovector[1];   /* the longest match */
+      int incr = 0;
+      if (from == to) { /* no progress: prevent endless loop */
+        if (last_end == to) {
+          argE.startoffset += ALG_CHARLEN (ud, argE.text, argE.textlen,
+                                           argE.startoffset);
+          continue;
+        }
+        incr = (int) ALG_CHARLEN (ud, argE.text, argE.textlen, to);
+      }
+      lua_pushinteger (L, (lua_Integer)(to + incr)); /* update start offset */
+      lua_replace (L, lua_upvalueindex (6));
+      lua_pushinteger (L, (lua_Integer)to);          /* update last end of match */
+      lua_replace (L, lua_upvalueindex (7));
+      lua_pushlstring (L, argE.text + from, to - from);
+      return 1;
+    }
+    else if (ALG_NOMATCH (res))
+      return 0;
+    else
+      return generate_error (L, ud, res);
+  }
 }
 
-static void gmatch_pushsubject (lua_State *L, TArgExec *argE) {
-  lua_pushlstring (L, argE->text, argE->textlen);
+/* method r:dfa_gmatch (s, [ef], [ovecsize], [wscount]) */
+static int Lpcre2_dfa_gmatch (lua_State *L) {
+  TArgExec argE;
+  int eflags;
+  TPcre2 *ud = check_ud (L);
+  check_subject (L, 2, &argE);
+  argE.eflags = (int)luaL_optinteger (L, 3, ALG_EFLAGS_DFLT);
+  argE.ovecsize = (size_t)luaL_optinteger (L, 4, 100);
+  argE.wscount = (size_t)luaL_optinteger (L, 5, 50);
+  eflags = argE.eflags;
+  prepare_subject (ud, &argE);
+  if (lua_type (L, 2) == LUA_TSTRING)   /* a buffer may change between calls */
+    eflags = argE.eflags;
+  lua_pushvalue (L, 1);                          /* 1-st upvalue: ud */
+  lua_pushvalue (L, 2);                          /* 2-nd upvalue: s  */
+  lua_pushinteger (L, eflags);                   /* 3-rd upvalue: ef */
+  lua_pushinteger (L, (lua_Integer)argE.ovecsize);
+  lua_pushinteger (L, (lua_Integer)argE.wscount);
+  lua_pushinteger (L, 0);                        /* 6-th upvalue: startoffset */
+  lua_pushinteger (L, -1);                       /* 7-th upvalue: last end of match */
+  lua_pushcclosure (L, dfa_gmatch_iter, 7);
+  return 1;
 }
 
-static int findmatch_exec (TPcre2 *ud, TArgExec *argE) {
-  return pcre2_match (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen,
-    argE->startoffset, argE->eflags, ud->match_data, NULL); //###
+/*  Streams
+ ******************************************************************************
+ *  A stream matches a regex against a subject that arrives in chunks. The
+ *  chunks are appended to a buffer, which is matched with PCRE2_PARTIAL_HARD:
+ *  the complete matches are returned, while the part of the buffer where a
+ *  partial match begins is kept for the next chunk. The rest of the buffer is
+ *  discarded, except for the characters that a lookbehind may need.
+ */
+typedef struct {
+  TPcre2 *ud;                   /* the regex (linked to the stream) */
+  char   *buf;
+  size_t  len, size;
+  size_t  base;                 /* stream offset of buf[0] */
+  size_t  pos;                  /* where the next search starts in buf */
+  size_t  lookbehind;           /* bytes kept before pos */
+  lua_Integer last_end;         /* stream offset of the last match end */
+  int     eflags;
+  int     finished;
+} TStream;
+
+static TStream *check_stream (lua_State *L) {
+  TStream *st;
+  if (lua_getmetatable (L, 1)) {
+    lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_STREAM_META);
+    if (lua_rawequal (L, -1, -2) && (st = (TStream*) lua_touserdata (L, 1)) != NULL) {
+      lua_pop (L, 2);
+      return st;
+    }
+  }
+  luaL_argerror (L, 1, lua_pushfstring (L, "not a %s", stream_typename));
+  return NULL;
 }
 
-static int gsub_exec (TPcre2 *ud, TArgExec *argE, int st) {
-  return pcre2_match (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen,
-    st, argE->eflags, ud->match_data, NULL); //###
+/* pushes the offsets of a match: start, end, then start/end of every capture */
+static void stream_push_match (lua_State *L, TStream *st) {
+  TPcre2 *ud = st->ud;
+  int i, j = 1;
+  lua_createtable (L, 2 * (ALG_NSUB(ud) + 1), 0);
+  for (i = 0; i <= ALG_NSUB(ud); i++) {
+    if (i == 0 || ALG_SUBVALID (ud,i)) {
+      lua_pushinteger (L, (lua_Integer)(st->base + ALG_SUBBEG(ud,i)) + 1);
+      lua_rawseti (L, -2, j++);
+      lua_pushinteger (L, (lua_Integer)(st->base + ALG_SUBEND(ud,i)));
+      lua_rawseti (L, -2, j++);
+    }
+    else {
+      lua_pushboolean (L, 0);
+      lua_rawseti (L, -2, j++);
+      lua_pushboolean (L, 0);
+      lua_rawseti (L, -2, j++);
+    }
+  }
 }
 
-static int split_exec (TPcre2 *ud, TArgExec *argE, int offset) {
-  return pcre2_match (ud->pr, (PCRE2_SPTR)argE->text, argE->textlen,
-    offset, argE->eflags, ud->match_data, NULL); //###
+/* Makes the matches possible in the buffer and pushes a table of them.
+   Unless the data is final, a match that reaches the end of the buffer
+   is not made: the search will be resumed when more data arrives. */
+static int stream_scan (lua_State *L, TStream *st, int final) {
+  TPcre2 *ud = st->ud;
+  uint32_t eflags = (uint32_t)st->eflags;
+  int n = 0;
+  size_t keep;
+
+  if (!final)
+    eflags |= PCRE2_PARTIAL_HARD;
+  if (st->base > 0)
+    eflags |= PCRE2_NOTBOL;        /* buf[0] is not the start of the stream */
+  lua_newtable (L);
+  while (st->pos <= st->len) {
+    int res = pcre2_match (ud->pr, (PCRE2_SPTR)st->buf, st->len, st->pos, eflags,
+                           ud->match_data, ud->mcontext);
+    if (ALG_ISMATCH (res)) {
+      size_t from = ud->ovector[0], to = ud->ovector[1];
+      if (from == to && (lua_Integer)(st->base + to) == st->last_end) {
+        /* discard an empty match adjacent to the previous match */
+        st->pos = to + ALG_CHARLEN (ud, st->buf, st->len, to);
+        continue;
+      }
+      stream_push_match (L, st);
+      lua_rawseti (L, -2, ++n);
+      st->last_end = (lua_Integer)(st->base + to);
+      st->pos = (from == to) ? to + ALG_CHARLEN (ud, st->buf, st->len, to) : to;
+    }
+    else if (res == PCRE2_ERROR_PARTIAL) {
+      st->pos = ud->ovector[0];        /* resume the search here */
+      break;
+    }
+    else if (ALG_NOMATCH (res)) {
+      st->pos = st->len;
+      break;
+    }
+    else
+      return generate_error (L, ud, res);
+  }
+  /* discard the data that is not needed anymore */
+  keep = (st->pos < st->len ? st->pos : st->len);
+  keep = (keep > st->lookbehind ? keep - st->lookbehind : 0);
+  if (keep > 0) {
+    memmove (st->buf, st->buf + keep, st->len - keep);
+    st->len -= keep;
+    st->pos -= keep;
+    st->base += keep;
+  }
+  return 1;
+}
+
+/* method r:stream ([ef]) */
+static int Lpcre2_stream (lua_State *L) {
+  TPcre2 *ud = check_ud (L);
+  int eflags = (int)luaL_optinteger (L, 2, ALG_EFLAGS_DFLT);
+  TStream *st = (TStream*) lua_newuserdata (L, sizeof (TStream));
+  memset (st, 0, sizeof (TStream));
+  st->ud = ud;
+  st->eflags = eflags;
+  st->last_end = -1;
+#ifdef PCRE2_INFO_MAXLOOKBEHIND
+  {
+    uint32_t lookbehind = 0;
+    pcre2_pattern_info (ud->pr, PCRE2_INFO_MAXLOOKBEHIND, &lookbehind);
+    st->lookbehind = ud->utf ? 4 * (size_t)lookbehind : lookbehind;
+  }
+#endif
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_STREAM_META);
+  lua_setmetatable (L, -2);
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_REGEX_LINK);
+  lua_pushvalue (L, -2);
+  lua_pushvalue (L, 1);
+  lua_rawset (L, -3);            /* keep the regex alive while the stream is */
+  lua_pop (L, 1);
+  return 1;
+}
+
+/* method st:feed (chunk) */
+static int stream_feed (lua_State *L) {
+  TStream *st = check_stream (L);
+  TArgExec argE;
+  const char *chunk;
+  size_t chunklen;
+  check_subject (L, 2, &argE);
+  chunk = argE.text;
+  chunklen = argE.textlen;
+  if (st->finished)
+    return luaL_error (L, "the stream is finished");
+  if (st->len + chunklen > st->size) {
+    size_t newsize = st->size ? st->size : 1024;
+    char *newbuf;
+    while (newsize < st->len + chunklen)
+      newsize *= 2;
+    newbuf = (char*) Lrealloc (L, st->buf, st->size, newsize);
+    if (!newbuf)
+      return luaL_error (L, "malloc failed");
+    st->buf = newbuf;
+    st->size = newsize;
+  }
+  memcpy (st->buf + st->len, chunk, chunklen);
+  st->len += chunklen;
+  return stream_scan (L, st, 0);
+}
+
+/* method st:finish () */
+static int stream_finish (lua_State *L) {
+  TStream *st = check_stream (L);
+  if (st->finished)
+    return luaL_error (L, "the stream is finished");
+  st->finished = 1;
+  return stream_scan (L, st, 1);
+}
+
+static int stream_gc (lua_State *L) {
+  TStream *st = check_stream (L);
+  if (st->buf) {
+    Lfree (L, st->buf, st->size);
+    st->buf = NULL;
+  }
+  return 0;
+}
+
+static int stream_tostring (lua_State *L) {
+  TStream *st = check_stream (L);
+  lua_pushfstring (L, "%s (%p)", stream_typename, (void*)st);
+  return 1;
+}
+
+/*  Regex sets
+ ******************************************************************************
+ *  A set compiles its patterns into one regex, whose branches are the patterns
+ *  in their order: (?:(*MARK:1)(?C1)(?:p1\E)(*MARK:1)(?C2)|...). When that
+ *  regex is too large, the patterns are split between several regexes
+ *  (shards). The leftmost match is found without callouts, and the mark tells
+ *  the pattern that made it. When all the matching patterns are wanted, the
+ *  callouts are enabled (the branch is found from the callout's pattern
+ *  position): callout 1 skips the patterns already found, and callout 2
+ *  records a pattern and makes the match fail, so that the search goes on
+ *  with the other branches and start positions.
+ */
+enum { RSET_ALL, RSET_FIRST };
+
+typedef struct {
+  TPcre2 *ud;                   /* the combined regex (linked to the set) */
+  int     base, count;          /* its patterns */
+} TSetShard;
+
+typedef struct {
+  int     n;                    /* number of patterns */
+  int     nshards;
+  int     nfound;               /* number of matched patterns (RSET_ALL) */
+  int     shard_found;          /* the same, in the current shard */
+  TSetShard *shard;             /* the current shard */
+  TSetShard *shards;
+  size_t *offs;                 /* start of every branch in its shard's pattern */
+  unsigned char *found;         /* matched patterns (RSET_ALL) */
+} TRegexSet;
+
+static TRegexSet *check_rset (lua_State *L) {
+  TRegexSet *rs;
+  if (lua_getmetatable (L, 1)) {
+    lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_SET_META);
+    if (lua_rawequal (L, -1, -2) && (rs = (TRegexSet*) lua_touserdata (L, 1)) != NULL) {
+      lua_pop (L, 2);
+      return rs;
+    }
+  }
+  luaL_argerror (L, 1, lua_pushfstring (L, "not a %s", set_typename));
+  return NULL;
+}
+
+static int rset_callout (pcre2_callout_block *cb, void *data) {
+  TRegexSet *rs = (TRegexSet*) data;
+  int lo = rs->shard->base, hi = lo + rs->shard->count - 1;
+  while (lo < hi) {              /* find the branch containing the callout */
+    int mid = (lo + hi + 1) / 2;
+    if (rs->offs[mid] <= cb->pattern_position) lo = mid;
+    else hi = mid - 1;
+  }
+  if (rs->found[lo])
+    return 1;                    /* the pattern has matched already: skip it */
+  if (cb->callout_number == 2) {
+    rs->found[lo] = 1;
+    ++rs->nfound;
+    if (++rs->shard_found == rs->shard->count)
+      return PCRE2_ERROR_CALLOUT;  /* all the patterns have matched: stop */
+    return 1;
+  }
+  return 0;
+}
+
+#ifdef PCRE2_EXTENDED_MORE
+#  define RSET_EXTENDED(cf) (((cf) & (PCRE2_EXTENDED | PCRE2_EXTENDED_MORE)) != 0)
+#else
+#  define RSET_EXTENDED(cf) (((cf) & PCRE2_EXTENDED) != 0)
+#endif
+
+/* Checks a pattern for the items that would act outside of it once it is
+   joined to others, and returns the error message if one is found, or NULL:
+   - a recursion, a subroutine call or a condition by number, as (?R), (?1),
+     (?-1), \g<1> or (?(1)...), which would refer to another group;
+   - a subroutine call by name, as (?&n), (?P>n) or \g<n>, which would call
+     the first group of that name, maybe in another pattern;
+   - a verb, as (*COMMIT), (*ACCEPT) or (*MARK:n), which would cut off the
+     other patterns or skip the mark of the pattern, and an option setting
+     verb, as (*UTF), which is allowed only at the start of the regex.
+   Comments are not skipped, so that some patterns are rejected needlessly. */
+static const char *rset_check_pattern (const char *p, size_t len) {
+  const char *end = p + len;
+  while (p < end) {
+    if (*p == '\\') {
+      if (++p == end)
+        break;
+      if (*p == 'Q') {                          /* skip to \E */
+        for (++p; p < end - 1 && !(p[0] == '\\' && p[1] == 'E'); p++) ;
+        p += 2;
+        continue;
+      }
+      if (*p == 'g' && p + 1 < end && (p[1] == '<' || p[1] == '\'')) {
+        p += 2;
+        if (p < end && (*p == '+' || *p == '-'))
+          p++;
+        if (p < end && isdigit ((unsigned char)*p))
+          return "references to groups by number are not supported in a set";
+        return "calls to groups by name are not supported in a set";
+      }
+      p++;
+    }
+    else if (*p == '[') {                        /* skip a character class */
+      p++;
+      if (p < end && *p == '^') p++;
+      if (p < end && *p == ']') p++;
+      while (p < end && *p != ']') {
+        if (*p == '\\') p++;
+        else if (*p == '[' && p + 1 < end && p[1] == ':') {
+          const char *q = strstr (p, ":]");
+          if (q && q < end) p = q + 1;
+        }
+        p++;
+      }
+      p++;
+    }
+    else if (*p == '(' && p + 2 < end && p[1] == '?') {
+      const char *q = p + 2;
+      if (*q == '&' || (*q == 'P' && p + 3 < end && q[1] == '>'))
+        return "calls to groups by name are not supported in a set";
+      if (*q == '(')                             /* a condition */
+        q++;
+      if (q < end && (*q == '+' || *q == '-'))
+        q++;
+      if (q < end && (*q == 'R' || isdigit ((unsigned char)*q)))
+        return "references to groups by number are not supported in a set";
+      p++;
+    }
+    else if (*p == '(' && p + 2 < end && p[1] == '*' &&
+             (isupper ((unsigned char)p[2]) || p[2] == ':'))
+      return "verbs such as (*COMMIT) or (*UTF) are not supported in a set";
+    else
+      p++;
+  }
+  return NULL;
+}
+
+/* joins the patterns base..base+count-1 (at stack index 1) into a pattern;
+   in extended mode, a newline ends a comment that a pattern may end with */
+static void rset_join (lua_State *L, TRegexSet *rs, int base, int count,
+                       int extended) {
+  TBuffer b;
+  TFreeList freelist;
+  int i;
+  freelist_init (&freelist);
+  buffer_init (&b, 1024, L, &freelist);
+  buffer_addlstring (&b, "(?:", 3);
+  for (i = base; i < base + count; i++) {
+    char mark[32];
+    size_t marklen = sprintf (mark, "(*MARK:%d)", i + 1);
+    if (i > base)
+      buffer_addlstring (&b, "|", 1);
+    rs->offs[i] = b.top;
+    buffer_addlstring (&b, mark, marklen);
+    buffer_addlstring (&b, "(?C1)(?:", 8);
+    lua_rawgeti (L, 1, i + 1);
+    buffer_addvalue (&b, -1);
+    lua_pop (L, 1);
+    if (extended)
+      buffer_addlstring (&b, "\\E\n)", 4);
+    else
+      buffer_addlstring (&b, "\\E)", 3);
+    buffer_addlstring (&b, mark, marklen);
+    buffer_addlstring (&b, "(?C2)", 5);
+  }
+  buffer_addlstring (&b, ")", 1);
+  buffer_pushresult (&b);
+  freelist_free (&freelist);
+}
+
+/* compiles the patterns base..base+count-1 into one or more shards;
+   the table of the shards' regexes is on the stack top */
+static void rset_compile (lua_State *L, TRegexSet *rs, TArgComp *argC,
+                          int base, int count) {
+  TSetShard *shard;
+  pcre2_code *code;
+  int errcode;
+  PCRE2_SIZE erroffset;
+  rset_join (L, rs, base, count, RSET_EXTENDED (argC->cflags));
+  argC->pattern = lua_tolstring (L, -1, &argC->patlen);
+  if (count > 1) {
+    code = pcre2_compile ((PCRE2_SPTR)argC->pattern, argC->patlen, argC->cflags,
+                          &errcode, &erroffset, NULL);
+    if (code)
+      pcre2_code_free (code);
+    else if (errcode == PCRE2_ERROR_PATTERN_TOO_LARGE) {
+      lua_pop (L, 1);
+      rset_compile (L, rs, argC, base, count / 2);
+      rset_compile (L, rs, argC, base + count / 2, count - count / 2);
+      return;
+    }
+  }
+  shard = &rs->shards[rs->nshards];
+  compile_regex (L, argC, &shard->ud);
+  shard->base = base;
+  shard->count = count;
+  lua_rawseti (L, -3, ++rs->nshards);
+  lua_pop (L, 1);
+}
+
+/* function set (patterns, [cf], [larg...]) */
+static int Lpcre2_set (lua_State *L) {
+  TArgComp argC;
+  TRegexSet *rs;
+  int i, n, errcode;
+  PCRE2_SIZE erroffset;
+
+  luaL_checktype (L, 1, LUA_TTABLE);
+  n = (int)lua_objlen (L, 1);
+  luaL_argcheck (L, n > 0, 1, "empty array");
+  argC.cflags = ALG_GETCFLAGS (L, 2);
+#ifdef PCRE2_LITERAL
+  luaL_argcheck (L, !(argC.cflags & PCRE2_LITERAL), 2, "LITERAL is not supported");
+#endif
+  ALG_GETCARGS (L, 3, &argC);
+  argC.cflags |= PCRE2_DUPNAMES;
+
+  rs = (TRegexSet*) lua_newuserdata (L, sizeof (TRegexSet) + n * sizeof (TSetShard) +
+                                        n * sizeof (size_t) + n);
+  memset (rs, 0, sizeof (TRegexSet));
+  rs->n = n;
+  rs->shards = (TSetShard*)(rs + 1);
+  rs->offs = (size_t*)(rs->shards + n);
+  rs->found = (unsigned char*)(rs->offs + n);
+
+  /* check the patterns one by one, alone and in the joined form */
+  for (i = 1; i <= n; i++) {
+    size_t patlen;
+    const char *pattern, *msg;
+    pcre2_code *code;
+    uint32_t backrefmax = 0;
+    lua_rawgeti (L, 1, i);
+    if (lua_type (L, -1) != LUA_TSTRING)
+      return luaL_error (L, "pattern %d is not a string", i);
+    pattern = lua_tolstring (L, -1, &patlen);
+    code = pcre2_compile ((PCRE2_SPTR)pattern, patlen, argC.cflags, &errcode,
+                          &erroffset, NULL);
+    if (!code) {
+      if (!push_error_message (L, errcode))
+        lua_pushliteral (L, "pattern compile error");
+      return luaL_error (L, "pattern %d: %s (pattern offset: %d)", i,
+                         lua_tostring (L, -1), (int)erroffset + 1);
+    }
+    pcre2_pattern_info (code, PCRE2_INFO_BACKREFMAX, &backrefmax);
+    pcre2_code_free (code);
+    if (backrefmax > 0)
+      return luaL_error (L, "pattern %d: back references are not supported in a set", i);
+    if ((msg = rset_check_pattern (pattern, patlen)) != NULL)
+      return luaL_error (L, "pattern %d: %s", i, msg);
+    rset_join (L, rs, i - 1, 1, RSET_EXTENDED (argC.cflags));
+    pattern = lua_tolstring (L, -1, &patlen);
+    code = pcre2_compile ((PCRE2_SPTR)pattern, patlen,
+                          argC.cflags | PCRE2_NO_AUTO_CAPTURE, &errcode, &erroffset, NULL);
+    if (!code) {
+      if (!push_error_message (L, errcode))
+        lua_pushliteral (L, "pattern compile error");
+      return luaL_error (L, "pattern %d: cannot be joined into a set: %s", i,
+                         lua_tostring (L, -1));
+    }
+    pcre2_code_free (code);
+    lua_pop (L, 2);
+  }
+  argC.cflags |= PCRE2_NO_AUTO_CAPTURE;     /* the set does not return captures */
+
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_REGEX_LINK);
+  lua_pushvalue (L, -2);
+  lua_newtable (L);
+  rset_compile (L, rs, &argC, 0, n);
+  lua_rawset (L, -3);            /* keep the regexes alive while the set is */
+  lua_pop (L, 1);
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_SET_META);
+  lua_setmetatable (L, -2);
+  return 1;
+}
+
+/* Runs the shards in the given mode. RSET_FIRST: returns the start of the
+   leftmost match and sets *first and *to, or returns ALG_NOPOS if there is no
+   match. */
+static size_t rset_exec (lua_State *L, TRegexSet *rs, int mode, int *first,
+                         size_t *to) {
+  TArgExec argE;
+  int i;
+  size_t from = ALG_NOPOS;
+  check_subject (L, 2, &argE);
+  argE.startoffset = get_startoffset (L, 3, argE.textlen);
+  argE.eflags = (int)luaL_optinteger (L, 4, ALG_EFLAGS_DFLT);
+  rs->nfound = 0;
+  if (mode == RSET_ALL)
+    memset (rs->found, 0, rs->n);
+  if (argE.startoffset > argE.textlen)
+    return ALG_NOPOS;
+  prepare_subject (rs->shards[0].ud, &argE);
+  for (i = 0; i < rs->nshards && from != argE.startoffset; i++) {
+    TPcre2 *ud = rs->shards[i].ud;
+    int res;
+    if (mode == RSET_ALL) {
+      TArgExec argA = argE;
+#ifdef PCRE2_NO_JIT
+      if (ud->ncapt > 0)           /* JIT callouts are slow with (named) captures */
+        argA.eflags |= PCRE2_NO_JIT;
+#endif
+      rs->shard = &rs->shards[i];
+      rs->shard_found = 0;
+      pcre2_set_callout (ud->mcontext, rset_callout, rs);
+      res = match (ud, &argA, argE.startoffset);
+      pcre2_set_callout (ud->mcontext, NULL, NULL);
+      if (res == PCRE2_ERROR_CALLOUT)
+        continue;                /* all the patterns of the shard have matched */
+    }
+    else {
+      res = match (ud, &argE, argE.startoffset);
+      if (ALG_ISMATCH (res) && (from == ALG_NOPOS || ALG_SUBBEG(ud,0) < from)) {
+        PCRE2_SPTR mark = pcre2_get_mark (ud->match_data);
+        from = ALG_SUBBEG(ud,0);
+        *to = ALG_SUBEND(ud,0);
+        *first = mark ? atoi ((const char*)mark) : 0;
+      }
+    }
+    if (!ALG_ISMATCH (res) && !ALG_NOMATCH (res))
+      return generate_error (L, ud, res);
+  }
+  return from;
+}
+
+/* method set:match (s, [st], [ef]) */
+static int rset_match (lua_State *L) {
+  TRegexSet *rs = check_rset (L);
+  int i, j = 0;
+  rset_exec (L, rs, RSET_ALL, NULL, NULL);
+  lua_createtable (L, rs->nfound, 0);
+  for (i = 0; i < rs->n && j < rs->nfound; i++) {
+    if (rs->found[i]) {
+      lua_pushinteger (L, i + 1);
+      lua_rawseti (L, -2, ++j);
+    }
+  }
+  return 1;
+}
+
+/* method set:first (s, [st], [ef]) */
+static int rset_first (lua_State *L) {
+  TRegexSet *rs = check_rset (L);
+  int first;
+  size_t from, to;
+  if ((from = rset_exec (L, rs, RSET_FIRST, &first, &to)) == ALG_NOPOS)
+    return lua_pushnil (L), 1;
+  lua_pushinteger (L, first);
+  lua_pushinteger (L, (lua_Integer)(from + 1));
+  lua_pushinteger (L, (lua_Integer)to);
+  return 3;
+}
+
+static int rset_len (lua_State *L) {
+  lua_pushinteger (L, check_rset (L)->n);
+  return 1;
+}
+
+static int rset_tostring (lua_State *L) {
+  TRegexSet *rs = check_rset (L);
+  lua_pushfstring (L, "%s (%p)", set_typename, (void*)rs);
+  return 1;
 }
 
 static int Lpcre2_gc (lua_State *L) {
   TPcre2 *ud = check_ud (L);
   if (ud->freed == 0) {           /* precaution against "manual" __gc calling */
     ud->freed = 1;
-    if (ud->pr) pcre2_code_free (ud->pr);
-    //if (ud->tables)  pcre_free ((void *)ud->tables); //###
+#ifndef REX_PCRE2_NOSHARE
+    if (ud->shared) shared_release (ud->shared);
+    else
+#endif
+      if (ud->pr) pcre2_code_free (ud->pr);
     if (ud->ccontext) pcre2_compile_context_free (ud->ccontext);
     if (ud->match_data) pcre2_match_data_free (ud->match_data);
+    if (ud->mcontext) pcre2_match_context_free (ud->mcontext);
+    if (ud->dfa_match_data) pcre2_match_data_free (ud->dfa_match_data);
+    if (ud->dfa_wspace) Lfree (L, ud->dfa_wspace, ud->dfa_wscount * sizeof (int));
+    if (ud->tables) tables_release (ud->tables);
+    literal_free (L, &ud->lit);
+    if (ud->names) luaL_unref (L, LUA_REGISTRYINDEX, ud->names);
   }
   return 0;
 }
@@ -378,7 +1534,7 @@ static int Lpcre2_version (lua_State *L) {
 static int Lpcre2_jit_compile (lua_State *L) {
   TPcre2 *ud = check_ud (L);
   uint32_t options = (uint32_t) luaL_optinteger (L, 2, PCRE2_JIT_COMPLETE);
-  int errcode = pcre2_jit_compile (ud->pr, options);
+  int errcode = jit_compile (ud, options);
   if (errcode == 0) {
     lua_pushboolean(L, 1);
     return 1;
@@ -387,6 +1543,246 @@ static int Lpcre2_jit_compile (lua_State *L) {
   return 1 + push_error_message(L, errcode);
 }
 
+static TJitPolicy *get_jit_policy (lua_State *L) {
+  TJitPolicy *policy;
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_JIT_POLICY);
+  policy = (TJitPolicy*) lua_touserdata (L, -1);
+  lua_pop (L, 1);
+  return policy;
+}
+
+/* function set_jit_policy ({ [mode=mode], [threshold=N] }) */
+static int Lpcre2_set_jit_policy (lua_State *L) {
+  static const char *const modes[] = { "never", "always", "adaptive", NULL };
+  TJitPolicy *policy = get_jit_policy (L);
+  int mode, threshold;
+  luaL_checktype (L, 1, LUA_TTABLE);
+  lua_settop (L, 1);
+  lua_getfield (L, 1, "mode");
+  if (lua_isnil (L, -1))
+    mode = policy->mode;
+  else {
+    const char *name = lua_tostring (L, -1);
+    for (mode = 0; modes[mode]; mode++) {
+      if (name && strcmp (name, modes[mode]) == 0)
+        break;
+    }
+    if (modes[mode] == NULL)
+      return luaL_argerror (L, 1, "invalid JIT mode");
+  }
+  lua_pop (L, 1);
+  threshold = get_int_field (L, "threshold");
+  if (threshold == 0)
+    threshold = (int)policy->threshold;
+  else if (threshold < 0)
+    return luaL_argerror (L, 1, "threshold must be positive");
+  policy->mode = mode;
+  policy->threshold = (size_t)threshold;
+  return 0;
+}
+
+static void jit_stack_free (TJitStack *js) {
+  if (js->stack) {
+    pcre2_jit_stack_free (js->stack);
+    js->stack = NULL;
+  }
+}
+
+static int jit_stack_gc (lua_State *L) {
+  jit_stack_free ((TJitStack*) lua_touserdata (L, 1));
+  return 0;
+}
+
+/* function config_jit_stack ([startsize], [maxsize]) */
+static int Lpcre2_config_jit_stack (lua_State *L) {
+  TJitStack *js;
+  lua_Integer startsize, maxsize;
+  lua_settop (L, 2);
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_JIT_STACK);
+  js = (TJitStack*) lua_touserdata (L, -1);
+  startsize = luaL_optinteger (L, 1, (lua_Integer)js->startsize);
+  maxsize = luaL_optinteger (L, 2, (lua_Integer)js->maxsize);
+  if (startsize <= 0)
+    return luaL_argerror (L, 1, "positive size expected");
+  if (maxsize < startsize)
+    return luaL_argerror (L, 2, "maximal size is less than the starting size");
+  jit_stack_free (js);                 /* the new stack will be created on use */
+  js->startsize = (size_t)startsize;
+  js->maxsize = (size_t)maxsize;
+  lua_pushinteger (L, (lua_Integer)js->startsize);
+  lua_pushinteger (L, (lua_Integer)js->maxsize);
+  return 2;
+}
+
+/* function set_default_limits ({ [match_limit=N], [depth_limit=N], [heap_limit=N] }) */
+static int Lpcre2_set_default_limits (lua_State *L) {
+  lua_settop (L, 1);
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_LIMITS);
+  set_default_limits (L, 1, (TMatchLimits*) lua_touserdata (L, -1));
+  return 0;
+}
+
+/*  Precompiled pattern bundles
+ ******************************************************************************
+ *  A bundle file consists of a header followed by the data produced by
+ *  pcre2_serialize_encode. The header records the version of the PCRE2
+ *  library that made the bundle, as serialized patterns can only be loaded
+ *  by the same version of PCRE2 on the same architecture.
+ */
+typedef struct {
+  char     magic[8];
+  char     version[48];       /* PCRE2_CONFIG_VERSION */
+  uint32_t hash;              /* FNV-1a of the serialized data */
+  uint32_t size;              /* size of the serialized data */
+} TBundleHeader;
+
+static const char bundle_magic[8] = "LRXPCRE2";
+
+static void bundle_header (TBundleHeader *hdr, const uint8_t *data, size_t size) {
+  memset (hdr, 0, sizeof (TBundleHeader));
+  memcpy (hdr->magic, bundle_magic, sizeof (hdr->magic));
+  pcre2_config (PCRE2_CONFIG_VERSION, hdr->version);
+  hdr->hash = fnv1a (data, size, FNV1A_INIT);
+  hdr->size = (uint32_t) size;
+}
+
+/* function save_bundle (path, regexes) */
+static int Lpcre2_save_bundle (lua_State *L) {
+  const char *path = luaL_checkstring (L, 1);
+  const pcre2_code **codes;
+  uint8_t *data;
+  PCRE2_SIZE size;
+  int32_t res;
+  int i, n, ok;
+  TBundleHeader hdr;
+  FILE *f;
+
+  luaL_checktype (L, 2, LUA_TTABLE);
+  n = (int) lua_objlen (L, 2);
+  codes = (const pcre2_code**) lua_newuserdata (L, (n ? n : 1) * sizeof (pcre2_code*));
+  for (i = 0; i < n; i++) {
+    TPcre2 *ud;
+    lua_rawgeti (L, 2, i + 1);
+    if ((ud = test_ud (L, lua_gettop (L))) == NULL || ud->freed)
+      return luaL_argerror (L, 2, lua_pushfstring (L,
+        "element %d is not a valid %s", i + 1, REX_TYPENAME));
+    codes[i] = ud->pr;
+    lua_pop (L, 1);
+  }
+  res = pcre2_serialize_encode (codes, n, &data, &size, NULL);
+  if (res < 0)
+    return generate_error (L, NULL, res);
+  if (size > UINT32_MAX) {
+    pcre2_serialize_free (data);
+    return luaL_error (L, "bundle too large");
+  }
+
+  bundle_header (&hdr, data, size);
+  if ((f = fopen (path, "wb")) == NULL) {
+    pcre2_serialize_free (data);
+    lua_pushnil (L);
+    lua_pushfstring (L, "cannot open %s", path);
+    return 2;
+  }
+  ok = fwrite (&hdr, sizeof (hdr), 1, f) == 1 && fwrite (data, 1, size, f) == size;
+  ok = (fclose (f) == 0) && ok;
+  pcre2_serialize_free (data);
+  if (!ok) {
+    lua_pushnil (L);
+    lua_pushfstring (L, "cannot write %s", path);
+    return 2;
+  }
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int bundle_fail (lua_State *L, FILE *f, const char *path, const char *msg) {
+  if (f) fclose (f);
+  lua_pushnil (L);
+  lua_pushfstring (L, "%s: %s", path, msg);
+  return 2;
+}
+
+/* function load_bundle (path, [jit]) */
+static int Lpcre2_load_bundle (lua_State *L) {
+  const char *path = luaL_checkstring (L, 1);
+  TBundleHeader hdr, check;
+  pcre2_code **codes;
+  uint8_t *data;
+  int32_t n, i;
+  uint32_t jitoptions = 0;
+  const TMatchLimits *limits;
+  FILE *f;
+  long end;
+
+  if (lua_isnumber (L, 2))
+    jitoptions = (uint32_t) lua_tointeger (L, 2);
+  else if (lua_toboolean (L, 2))
+    jitoptions = PCRE2_JIT_COMPLETE;
+
+  if ((f = fopen (path, "rb")) == NULL)
+    return bundle_fail (L, NULL, path, "cannot open file");
+  if (fread (&hdr, sizeof (hdr), 1, f) != 1 ||
+      memcmp (hdr.magic, bundle_magic, sizeof (hdr.magic)) != 0)
+    return bundle_fail (L, f, path, "not a bundle file");
+  bundle_header (&check, NULL, 0);
+  if (memcmp (hdr.version, check.version, sizeof (hdr.version)) != 0)
+    return bundle_fail (L, f, path, "bundle made by a different version of PCRE2");
+  /* the size must be that of the rest of the file */
+  if (fseek (f, 0, SEEK_END) != 0 || (end = ftell (f)) < 0 ||
+      (unsigned long)end - sizeof (hdr) != hdr.size)
+    return bundle_fail (L, f, path, "bundle file is corrupted");
+  fclose (f);      /* before allocating, which may raise an error */
+  data = (uint8_t*) lua_newuserdata (L, hdr.size ? hdr.size : 1);
+  if ((f = fopen (path, "rb")) == NULL)
+    return bundle_fail (L, NULL, path, "cannot open file");
+  if (fseek (f, (long)sizeof (hdr), SEEK_SET) != 0 ||
+      fread (data, 1, hdr.size, f) != hdr.size ||
+      fnv1a (data, hdr.size, FNV1A_INIT) != hdr.hash)
+    return bundle_fail (L, f, path, "bundle file is corrupted");
+  fclose (f);
+
+  lua_rawgeti (L, ALG_ENVIRONINDEX, INDEX_LIMITS);
+  limits = (const TMatchLimits*) lua_touserdata (L, -1);
+  lua_pop (L, 1);
+
+  n = pcre2_serialize_get_number_of_codes (data);
+  if (n < 0)
+    return generate_error (L, NULL, n);
+  lua_createtable (L, n, 0);
+  /* create the regex objects first, so that they own the codes at once */
+  for (i = 0; i < n; i++) {
+    TPcre2 *ud = (TPcre2*)lua_newuserdata (L, sizeof (TPcre2));
+    memset (ud, 0, sizeof (TPcre2));
+    lua_pushvalue (L, ALG_ENVIRONINDEX);
+    lua_setmetatable (L, -2);
+    lua_rawseti (L, -2, i + 1);
+  }
+  codes = (pcre2_code**) lua_newuserdata (L, (n ? n : 1) * sizeof (pcre2_code*));
+  n = pcre2_serialize_decode (codes, n, data, NULL);
+  if (n < 0)
+    return generate_error (L, NULL, n);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti (L, -2, i + 1);
+    ((TPcre2*)lua_touserdata (L, -1))->pr = codes[i];
+    lua_pop (L, 1);
+  }
+  lua_pop (L, 1);
+  for (i = 0; i < n; i++) {
+    TPcre2 *ud;
+    lua_rawgeti (L, -1, i + 1);
+    ud = (TPcre2*)lua_touserdata (L, -1);
+    prepare_match (L, ud, limits);
+    if (jitoptions) {
+      int errcode = jit_compile (ud, jitoptions);
+      if (errcode != 0)
+        return generate_error (L, ud, errcode);
+    }
+    lua_pop (L, 1);
+  }
+  return 1;
+}
+
 #define SET_INFO_FIELD(L,ud,what,name,valtype) { \
   valtype val; \
   if (0 == pcre2_pattern_info (ud->pr, what, &val)) { \
@@ -433,12 +1829,37 @@ static const luaL_Reg chartables_meta[] = {
   { NULL, NULL }
 };
 
+static const luaL_Reg stream_meta[] = {
+  { "feed",        stream_feed },
+  { "finish",      stream_finish },
+  { "__gc",        stream_gc },
+  { "__tostring",  stream_tostring },
+  { NULL, NULL }
+};
+
+static const luaL_Reg set_meta[] = {
+  { "match",       rset_match },
+  { "first",       rset_first },
+  { "__len",       rset_len },
+  { "__tostring",  rset_tostring },
+  { NULL, NULL }
+};
+
 static const luaL_Reg r_methods[] = {
   { "exec",        algm_exec },
   { "tfind",       algm_tfind },    /* old name: match */
   { "find",        algm_find },
   { "match",       algm_match },
+  { "test",        algm_test },
+  { "search",      algm_search },
+  { "find_all",    algm_find_all },
+  { "grep",        algm_grep },
+  { "test_batch",  algm_test_batch },
+  { "exec_batch",  algm_exec_batch },
+  { "count_batch", algm_count_batch },
   { "dfa_exec",    Lpcre2_dfa_exec },
+  { "dfa_gmatch",  Lpcre2_dfa_gmatch },
+  { "stream",      Lpcre2_stream },
   { "patterninfo", Lpcre2_pattern_info }, //### document name change: fullinfo -> patterninfo
   { "fullinfo",    Lpcre2_pattern_info }, //### compatibility name
   { "jit_compile", Lpcre2_jit_compile },
@@ -450,15 +1871,27 @@ static const luaL_Reg r_methods[] = {
 static const luaL_Reg r_functions[] = {
   { "match",       algf_match },
   { "find",        algf_find },
+  { "test",        algf_test },
+  { "search",      algf_search },
+  { "find_all",    algf_find_all },
   { "gmatch",      algf_gmatch },
   { "gsub",        algf_gsub },
   { "count",       algf_count },
   { "split",       algf_split },
   { "new",         algf_new },
+  { "cache_stats", algf_cache_stats },
+  { "cache_clear", algf_cache_clear },
+  { "cache_config", algf_cache_config },
   { "flags",       Lpcre2_get_flags },
   { "version",     Lpcre2_version },
   { "maketables",  Lpcre2_maketables },
   { "config",      Lpcre2_config },
+  { "save_bundle", Lpcre2_save_bundle },
+  { "load_bundle", Lpcre2_load_bundle },
+  { "set",         Lpcre2_set },
+  { "set_jit_policy", Lpcre2_set_jit_policy },
+  { "config_jit_stack", Lpcre2_config_jit_stack },
+  { "set_default_limits", Lpcre2_set_default_limits },
   { NULL, NULL }
 };
 
@@ -498,5 +1931,84 @@ REX_API int REX_OPENLIB (lua_State *L) {
   lua_rawseti (L, -3, INDEX_CHARTABLES_LINK);
 #endif
 
+  /* create the JIT policy */
+  {
+    TJitPolicy *policy = (TJitPolicy*) lua_newuserdata (L, sizeof (TJitPolicy));
+    policy->mode = REX_PCRE2_JIT_MODE;
+    policy->threshold = REX_PCRE2_JIT_THRESHOLD;
+  }
+#if LUA_VERSION_NUM == 501
+  lua_rawseti (L, LUA_ENVIRONINDEX, INDEX_JIT_POLICY);
+#else
+  lua_rawseti (L, -3, INDEX_JIT_POLICY);
+#endif
+
+  /* create the JIT stack holder */
+  {
+    TJitStack *js = (TJitStack*) lua_newuserdata (L, sizeof (TJitStack));
+    js->stack = NULL;
+    js->startsize = REX_PCRE2_JIT_STACK_MIN;
+    js->maxsize = REX_PCRE2_JIT_STACK_MAX;
+  }
+  lua_newtable (L);
+  lua_pushcfunction (L, jit_stack_gc);
+  lua_setfield (L, -2, "__gc");
+  lua_setmetatable (L, -2);
+#if LUA_VERSION_NUM == 501
+  lua_rawseti (L, LUA_ENVIRONINDEX, INDEX_JIT_STACK);
+#else
+  lua_rawseti (L, -3, INDEX_JIT_STACK);
+#endif
+
+  /* create the default match limits */
+  memset (lua_newuserdata (L, sizeof (TMatchLimits)), 0, sizeof (TMatchLimits));
+#if LUA_VERSION_NUM == 501
+  lua_rawseti (L, LUA_ENVIRONINDEX, INDEX_LIMITS);
+#else
+  lua_rawseti (L, -3, INDEX_LIMITS);
+#endif
+
+  /* create the metatable of streams */
+  lua_newtable (L);
+  lua_pushliteral (L, "access denied");
+  lua_setfield (L, -2, "__metatable");
+  lua_pushvalue (L, -1);
+  lua_setfield (L, -2, "__index");
+#if LUA_VERSION_NUM == 501
+  luaL_register (L, NULL, stream_meta);
+  lua_rawseti (L, LUA_ENVIRONINDEX, INDEX_STREAM_META);
+#else
+  lua_pushvalue(L, -3);
+  luaL_setfuncs (L, stream_meta, 1);
+  lua_rawseti (L, -3, INDEX_STREAM_META);
+#endif
+
+  /* create the metatable of sets */
+  lua_newtable (L);
+  lua_pushliteral (L, "access denied");
+  lua_setfield (L, -2, "__metatable");
+  lua_pushvalue (L, -1);
+  lua_setfield (L, -2, "__index");
+#if LUA_VERSION_NUM == 501
+  luaL_register (L, NULL, set_meta);
+  lua_rawseti (L, LUA_ENVIRONINDEX, INDEX_SET_META);
+#else
+  lua_pushvalue(L, -3);
+  luaL_setfuncs (L, set_meta, 1);
+  lua_rawseti (L, -3, INDEX_SET_META);
+#endif
+
+  /* create a table for connecting streams and sets to their regexes */
+  lua_newtable (L);
+  lua_pushliteral (L, "k");         /* weak keys */
+  lua_setfield (L, -2, "__mode");
+  lua_pushvalue (L, -1);            /* setmetatable (tb, tb) */
+  lua_setmetatable (L, -2);
+#if LUA_VERSION_NUM == 501
+  lua_rawseti (L, LUA_ENVIRONINDEX, INDEX_REGEX_LINK);
+#else
+  lua_rawseti (L, -3, INDEX_REGEX_LINK);
+#endif
+
   return 1;
 }
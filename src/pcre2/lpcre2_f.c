@@ -131,12 +131,18 @@ flag_pair pcre2_error_flags[] = {
   { "ERROR_BADREPLACEMENT",          PCRE2_ERROR_BADREPLACEMENT },
   { "ERROR_BADUTFOFFSET",            PCRE2_ERROR_BADUTFOFFSET },
   { "ERROR_CALLOUT",                 PCRE2_ERROR_CALLOUT },
+#ifdef PCRE2_ERROR_DEPTHLIMIT
+  { "ERROR_DEPTHLIMIT",              PCRE2_ERROR_DEPTHLIMIT },
+#endif
   { "ERROR_DFA_BADRESTART",          PCRE2_ERROR_DFA_BADRESTART },
   { "ERROR_DFA_RECURSE",             PCRE2_ERROR_DFA_RECURSE },
   { "ERROR_DFA_UCOND",               PCRE2_ERROR_DFA_UCOND },
   { "ERROR_DFA_UFUNC",               PCRE2_ERROR_DFA_UFUNC },
   { "ERROR_DFA_UITEM",               PCRE2_ERROR_DFA_UITEM },
   { "ERROR_DFA_WSSIZE",              PCRE2_ERROR_DFA_WSSIZE },
+#ifdef PCRE2_ERROR_HEAPLIMIT
+  { "ERROR_HEAPLIMIT",               PCRE2_ERROR_HEAPLIMIT },
+#endif
   { "ERROR_INTERNAL",                PCRE2_ERROR_INTERNAL },
   { "ERROR_JIT_BADOPTION",           PCRE2_ERROR_JIT_BADOPTION },
   { "ERROR_JIT_STACKLIMIT",          PCRE2_ERROR_JIT_STACKLIMIT },
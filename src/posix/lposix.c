@@ -47,10 +47,10 @@
 
 #define ALG_NOMATCH(res)   ((res) == REG_NOMATCH)
 #define ALG_ISMATCH(res)   ((res) == 0)
-#define ALG_SUBBEG(ud,n)   ud->match[n].rm_so
-#define ALG_SUBEND(ud,n)   ud->match[n].rm_eo
+#define ALG_SUBBEG(ud,n)   ((ud)->shift + (ud)->match[n].rm_so)
+#define ALG_SUBEND(ud,n)   ((ud)->shift + (ud)->match[n].rm_eo)
 #define ALG_SUBLEN(ud,n)   (ALG_SUBEND(ud,n) - ALG_SUBBEG(ud,n))
-#define ALG_SUBVALID(ud,n) (ALG_SUBBEG(ud,n) >= 0)
+#define ALG_SUBVALID(ud,n) ((ud)->match[n].rm_so >= 0)
 #ifdef REX_NSUB_BASE1
 #  define ALG_NSUB(ud)     ((int)ud->r.re_nsub - 1)
 #else
@@ -74,11 +74,16 @@
 typedef struct {
   regex_t      r;
   regmatch_t * match;
+  size_t       shift;         /* offset of the window the match was found in */
+  TLiteral     lit;
   int          freed;
 } TPosix;
 
 #define TUserdata TPosix
 
+static int test_exec (TPosix *ud, TArgExec *argE);
+#define ALG_TEST_EXEC(ud,argE) test_exec (ud, argE)
+
 #include "../algo.h"
 
 /*  Functions
@@ -112,6 +117,19 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TPosix **pud) {
   ud->match = (regmatch_t *) Lmalloc (L, (ALG_NSUB(ud) + 1) * sizeof (regmatch_t));
   if (!ud->match)
     luaL_error (L, "malloc failed");
+  {
+    int syntax = (argC->cflags & REG_EXTENDED) ? LIT_EXTENDED : 0;
+    size_t len = strlen (argC->pattern);
+#ifdef REX_POSIX_EXT
+    if (argC->cflags & REG_NOSPEC)
+      syntax = LIT_WHOLE;
+    if (argC->cflags & REG_PEND)
+      len = argC->patlen;
+#endif
+    literal_extract (L, &ud->lit, argC->pattern, len, syntax);
+    if (argC->cflags & REG_ICASE)
+      literal_fold_locale (L, &ud->lit);
+  }
   lua_pushvalue (L, ALG_ENVIRONINDEX);
   lua_setmetatable (L, -2);
 
@@ -119,66 +137,148 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TPosix **pud) {
   return 1;
 }
 
-static int gmatch_exec (TUserdata *ud, TArgExec *argE) {
-  if (argE->startoffset > 0)
-    argE->eflags |= REG_NOTBOL;
+/* Runs regexec on text[so..eo), which must not contain '\0' without
+   REG_STARTEND, storing nmatch offsets (0: none, a mere test). A pattern that
+   is a literal string is just searched for. Otherwise the subjects lacking the
+   required literal are rejected, and when it is a prefix of every match, the
+   search starts at its first occurrence. */
+static int posix_exec1 (TPosix *ud, const char *text, size_t so, size_t eo,
+                        int eflags, int nmatch) {
+  ptrdiff_t skip;
+  int res, i;
+  if (ud->lit.len == 0)
+    skip = 0;
+  else {
+#ifdef REG_STARTEND
+    if (!(eflags & REG_STARTEND))
+#endif
+      eo = so + strlen (text + so);
+    if (ud->lit.whole) {
+      ptrdiff_t pos = literal_find (&ud->lit, text + so, eo - so);
+      if (pos < 0)
+        return REG_NOMATCH;
+      ud->match[0].rm_so = so + pos;
+      ud->match[0].rm_eo = so + pos + ud->lit.len;
+      return 0;
+    }
+    if ((skip = literal_skip (&ud->lit, text + so, eo - so)) < 0)
+      return REG_NOMATCH;
+  }
+#ifdef REG_STARTEND
+  if (eflags & REG_STARTEND) {
+    ud->match[0].rm_so = so + skip;
+    ud->match[0].rm_eo = eo;
+    return regexec (&ud->r, text, nmatch, ud->match, eflags);
+  }
+#endif
+  if (skip == 0)
+    return regexec (&ud->r, text + so, nmatch, ud->match, eflags);
+  res = regexec (&ud->r, text + so + skip, nmatch, ud->match, eflags | REG_NOTBOL);
+  if (res == 0) {
+    for (i = 0; i < nmatch; i++) {
+      if (ALG_SUBVALID(ud,i)) {
+        ud->match[i].rm_so += skip;
+        ud->match[i].rm_eo += skip;
+      }
+    }
+  }
+  return res;
+}
 
+/* The same for a subject of any length: with REG_STARTEND, one whose offsets
+   could overflow regoff_t is searched one window at a time, and the offsets
+   of the match are relative to ud->shift. A match that may go on past the
+   window is searched for again in a window starting where it does, so the
+   offsets of the whole match are wanted in a window even for a test. */
+static int posix_regexec (TPosix *ud, const char *text, size_t so, size_t eo,
+                          int eflags, int nmatch) {
+  ud->shift = 0;
 #ifdef REG_STARTEND
-  if (argE->eflags & REG_STARTEND) {
-    ALG_SUBBEG(ud,0) = 0;
-    ALG_SUBEND(ud,0) = argE->textlen - argE->startoffset;
+  if ((eflags & REG_STARTEND) && eo > REX_WINDOW) {
+    int res;
+    if (so > 0)
+      eflags |= REG_NOTBOL;
+    for (;;) {
+      size_t len = eo - so;
+      if (len <= REX_WINDOW) {
+        res = posix_exec1 (ud, text + so, 0, len, eflags, nmatch);
+        break;
+      }
+      res = posix_exec1 (ud, text + so, 0, REX_WINDOW, eflags | REG_NOTEOL,
+                         nmatch > 0 ? nmatch : 1);
+      if (res == REG_NOMATCH)
+        so += REX_WINDOW - REX_WINDOW_OVERLAP;
+      else if (res == 0 && ud->match[0].rm_so > 0 &&
+               (size_t)ud->match[0].rm_eo > REX_WINDOW - REX_WINDOW_OVERLAP)
+        so += ud->match[0].rm_so;
+      else
+        break;
+      eflags |= REG_NOTBOL;
+    }
+    ud->shift = so;
+    return res;
   }
 #endif
+  return posix_exec1 (ud, text, so, eo, eflags, nmatch);
+}
 
+static int gmatch_exec (TUserdata *ud, TArgExec *argE) {
+  if (argE->startoffset > 0)
+    argE->eflags |= REG_NOTBOL;
   argE->text += argE->startoffset;
-  return regexec (&ud->r, argE->text, ALG_NSUB(ud) + 1, ud->match, argE->eflags);
+  return posix_regexec (ud, argE->text, 0, argE->textlen - argE->startoffset,
+                        argE->eflags, ALG_NSUB(ud) + 1);
 }
 
-static void gmatch_pushsubject (lua_State *L, TArgExec *argE) {
+/* without REG_STARTEND, regexec stops at the first zero byte of the subject */
+static void gmatch_pushsubject (lua_State *L, TArgExec *argE, int pos) {
 #ifdef REG_STARTEND
-  if (argE->eflags & REG_STARTEND)
-    lua_pushlstring (L, argE->text, argE->textlen);
-  else
+  if (!(argE->eflags & REG_STARTEND) &&
+      memchr (argE->text, 0, argE->textlen) != NULL)
+#else
+  if (memchr (argE->text, 0, argE->textlen) != NULL)
 #endif
     lua_pushstring (L, argE->text);
+  else
+    lua_pushvalue (L, pos);
 }
 
-static int findmatch_exec (TPosix *ud, TArgExec *argE) {
+static int find_exec (TPosix *ud, TArgExec *argE, int nmatch) {
+  size_t so = argE->startoffset, eo = argE->textlen;
 #ifdef REG_STARTEND
-  if (argE->eflags & REG_STARTEND) {
-    ud->match[0].rm_so = argE->startoffset;
-    ud->match[0].rm_eo = argE->textlen;
+  if (argE->eflags & REG_STARTEND)
     argE->startoffset = 0;
-  }
   else
 #endif
-    argE->text += argE->startoffset;
-  return regexec (&ud->r, argE->text, ALG_NSUB(ud) + 1, ud->match, argE->eflags);
+  {
+    argE->text += so;
+    eo -= so;
+    so = 0;
+  }
+  return posix_regexec (ud, argE->text, so, eo, argE->eflags, nmatch);
 }
 
-static int gsub_exec (TPosix *ud, TArgExec *argE, int st) {
-#ifdef REG_STARTEND
-  if(argE->eflags & REG_STARTEND) {
-    ALG_SUBBEG(ud,0) = 0;
-    ALG_SUBEND(ud,0) = argE->textlen - st;
-  }
-#endif
+static int findmatch_exec (TPosix *ud, TArgExec *argE) {
+  return find_exec (ud, argE, ALG_NSUB(ud) + 1);
+}
+
+/* without the match offsets, regexec needs not track the subexpressions */
+static int test_exec (TPosix *ud, TArgExec *argE) {
+  return find_exec (ud, argE, 0);
+}
+
+static int gsub_exec (TPosix *ud, TArgExec *argE, size_t st) {
   if (st > 0)
     argE->eflags |= REG_NOTBOL;
-  return regexec (&ud->r, argE->text+st, ALG_NSUB(ud)+1, ud->match, argE->eflags);
+  return posix_regexec (ud, argE->text + st, 0, argE->textlen - st, argE->eflags,
+                        ALG_NSUB(ud) + 1);
 }
 
-static int split_exec (TPosix *ud, TArgExec *argE, int offset) {
-#ifdef REG_STARTEND
-  if (argE->eflags & REG_STARTEND) {
-    ALG_SUBBEG(ud,0) = 0;
-    ALG_SUBEND(ud,0) = argE->textlen - offset;
-  }
-#endif
+static int split_exec (TPosix *ud, TArgExec *argE, size_t offset) {
   if (offset > 0)
     argE->eflags |= REG_NOTBOL;
-
-  return regexec (&ud->r, argE->text + offset, ALG_NSUB(ud) + 1, ud->match, argE->eflags);
+  return posix_regexec (ud, argE->text + offset, 0, argE->textlen - offset,
+                        argE->eflags, ALG_NSUB(ud) + 1);
 }
 
 static int Posix_gc (lua_State *L) {
@@ -187,6 +287,7 @@ static int Posix_gc (lua_State *L) {
     ud->freed = 1;
     regfree (&ud->r);
     Lfree (L, ud->match, (ALG_NSUB(ud) + 1) * sizeof (regmatch_t));
+    literal_free (L, &ud->lit);
   }
   return 0;
 }
@@ -253,6 +354,13 @@ static const luaL_Reg r_methods[] = {
   { "tfind",      algm_tfind },    /* old match */
   { "find",       algm_find },
   { "match",      algm_match },
+  { "test",       algm_test },
+  { "search",     algm_search },
+  { "find_all",   algm_find_all },
+  { "grep",       algm_grep },
+  { "test_batch", algm_test_batch },
+  { "exec_batch", algm_exec_batch },
+  { "count_batch", algm_count_batch },
   { "__gc",       Posix_gc },
   { "__tostring", Posix_tostring },
   { NULL, NULL}
@@ -261,11 +369,17 @@ static const luaL_Reg r_methods[] = {
 static const luaL_Reg r_functions[] = {
   { "match",      algf_match },
   { "find",       algf_find },
+  { "test",       algf_test },
+  { "search",     algf_search },
+  { "find_all",   algf_find_all },
   { "gmatch",     algf_gmatch },
   { "gsub",       algf_gsub },
   { "count",      algf_count },
   { "split",      algf_split },
   { "new",        algf_new },
+  { "cache_stats", algf_cache_stats },
+  { "cache_clear", algf_cache_clear },
+  { "cache_config", algf_cache_config },
   { "flags",      Posix_get_flags },
   { NULL, NULL }
 };
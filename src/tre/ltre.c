@@ -28,10 +28,10 @@ extern void add_wide_lib (lua_State *L);
 
 #define ALG_NOMATCH(res)   ((res) == REG_NOMATCH)
 #define ALG_ISMATCH(res)   ((res) == 0)
-#define ALG_SUBBEG(ud,n)   ud->match[n].rm_so
-#define ALG_SUBEND(ud,n)   ud->match[n].rm_eo
+#define ALG_SUBBEG(ud,n)   ((ud)->shift + (ud)->match[n].rm_so)
+#define ALG_SUBEND(ud,n)   ((ud)->shift + (ud)->match[n].rm_eo)
 #define ALG_SUBLEN(ud,n)   (ALG_SUBEND(ud,n) - ALG_SUBBEG(ud,n))
-#define ALG_SUBVALID(ud,n) (ALG_SUBBEG(ud,n) >= 0)
+#define ALG_SUBVALID(ud,n) ((ud)->match[n].rm_so >= 0)
 #define ALG_NSUB(ud)       ((int)ud->r.re_nsub)
 
 #define ALG_PUSHSUB(L,ud,text,n) \
@@ -51,11 +51,16 @@ extern void add_wide_lib (lua_State *L);
 typedef struct {
   regex_t      r;
   regmatch_t * match;
+  size_t       shift;         /* offset of the window the match was found in */
+  TLiteral     lit;
   int          freed;
 } TPosix;
 
 #define TUserdata TPosix
 
+static int test_exec (TPosix *ud, TArgExec *argE);
+#define ALG_TEST_EXEC(ud,argE) test_exec (ud, argE)
+
 #include "../algo.h"
 
 /*  Functions
@@ -110,6 +115,14 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TPosix **pud) {
   ud->match = (regmatch_t *) Lmalloc (L, (ALG_NSUB(ud) + 1) * sizeof (regmatch_t));
   if (!ud->match)
     luaL_error (L, "malloc failed");
+  if (!tre_have_approx (&ud->r)) {
+    int syntax = (argC->cflags & REG_EXTENDED) ? LIT_EXTENDED : 0;
+    if (argC->cflags & REG_LITERAL)
+      syntax = LIT_WHOLE;
+    literal_extract (L, &ud->lit, argC->pattern, argC->patlen, syntax);
+    if (argC->cflags & REG_ICASE)
+      literal_fold_locale (L, &ud->lit);
+  }
   lua_pushvalue (L, ALG_ENVIRONINDEX);
   lua_setmetatable (L, -2);
 
@@ -125,9 +138,10 @@ static int generic_atfind (lua_State *L, int tfind) {
   regamatch_t res_match;
 
   checkarg_atfind (L, &argE, &ud, &argP);
-  if (argE.startoffset > (int)argE.textlen)
+  if (argE.startoffset > argE.textlen)
     return lua_pushnil(L), 1;
 
+  ud->shift = 0;
   argE.text += argE.startoffset;
   res_match.nmatch = ALG_NSUB(ud) + 1;
   res_match.pmatch = ud->match;
@@ -138,9 +152,9 @@ static int generic_atfind (lua_State *L, int tfind) {
   if (ALG_ISMATCH (res)) {
     ALG_PUSHOFFSETS (L, ud, argE.startoffset, 0);
     if (tfind)
-      push_substring_table (L, ud, argE.text);
+      push_substring_table (L, ud, argE.text, 0);
     else
-      push_offset_table (L, ud, argE.startoffset);
+      push_offset_table (L, ud, argE.startoffset, 0);
     /* set values in the dictionary part of the table */
     set_int_field (L, "cost", res_match.cost);
     set_int_field (L, "num_ins", res_match.num_ins);
@@ -162,36 +176,106 @@ static int Ltre_aexec (lua_State *L) {
   return generic_atfind (L, 0);
 }
 
+/* Runs tre_regnexec on text[0..len), storing nmatch offsets (0: none, a mere
+   test). A pattern that is a literal string is just searched for. Otherwise
+   the subjects lacking the required literal are rejected, and when it is a
+   prefix of every match, the search starts at its first occurrence. */
+static int tre_exec1 (TPosix *ud, const char *text, size_t len, int eflags,
+                      int nmatch) {
+  int i, res;
+  ptrdiff_t skip;
+  if (ud->lit.whole) {
+    ptrdiff_t pos = literal_find (&ud->lit, text, len);
+    if (pos < 0)
+      return REG_NOMATCH;
+    ud->match[0].rm_so = pos;
+    ud->match[0].rm_eo = pos + ud->lit.len;
+    return 0;
+  }
+  if ((skip = literal_skip (&ud->lit, text, len)) < 0)
+    return REG_NOMATCH;
+  if (skip == 0)
+    return tre_regnexec (&ud->r, text, len, nmatch, ud->match, eflags);
+  res = tre_regnexec (&ud->r, text + skip, len - skip, nmatch, ud->match,
+                      eflags | REG_NOTBOL);
+  if (res == 0) {
+    for (i = 0; i < nmatch; i++) {
+      if (ALG_SUBVALID(ud,i)) {
+        ud->match[i].rm_so += skip;
+        ud->match[i].rm_eo += skip;
+      }
+    }
+  }
+  return res;
+}
+
+/* The same for a subject of any length: one longer than REX_WINDOW is
+   searched one window at a time, and the offsets of the match are relative to
+   ud->shift. A match that may go on past the window is searched for again in
+   a window starting where it does, so the offsets of the whole match are
+   wanted in a window even for a test. */
+static int tre_exec (TPosix *ud, const char *text, size_t len, int eflags,
+                     int nmatch) {
+  int res;
+  size_t so = 0;
+  for (;;) {
+    if (len - so <= REX_WINDOW) {
+      res = tre_exec1 (ud, text + so, len - so, eflags, nmatch);
+      break;
+    }
+    ud->match[0].rm_so = -1;       /* left as is with REG_NOSUB */
+    res = tre_exec1 (ud, text + so, REX_WINDOW, eflags | REG_NOTEOL,
+                     nmatch > 0 ? nmatch : 1);
+    if (res == REG_NOMATCH)
+      so += REX_WINDOW - REX_WINDOW_OVERLAP;
+    else if (res == 0 && ud->match[0].rm_so > 0 &&
+             (size_t)ud->match[0].rm_eo > REX_WINDOW - REX_WINDOW_OVERLAP)
+      so += ud->match[0].rm_so;
+    else
+      break;
+    eflags |= REG_NOTBOL;
+  }
+  ud->shift = so;
+  return res;
+}
+
 static int gmatch_exec (TUserdata *ud, TArgExec *argE) {
   if (argE->startoffset > 0)
     argE->eflags |= REG_NOTBOL;
   argE->text += argE->startoffset;
-  return tre_regnexec (&ud->r, argE->text, argE->textlen - argE->startoffset,
-                   ALG_NSUB(ud) + 1, ud->match, argE->eflags);
+  return tre_exec (ud, argE->text, argE->textlen - argE->startoffset, argE->eflags,
+                   ALG_NSUB(ud) + 1);
 }
 
-static void gmatch_pushsubject (lua_State *L, TArgExec *argE) {
-  lua_pushlstring (L, argE->text, argE->textlen);
+static void gmatch_pushsubject (lua_State *L, TArgExec *argE, int pos) {
+  (void)argE;
+  lua_pushvalue (L, pos);
 }
 
 static int findmatch_exec (TPosix *ud, TArgExec *argE) {
   argE->text += argE->startoffset;
-  return tre_regnexec (&ud->r, argE->text, argE->textlen - argE->startoffset,
-                   ALG_NSUB(ud) + 1, ud->match, argE->eflags);
+  return tre_exec (ud, argE->text, argE->textlen - argE->startoffset, argE->eflags,
+                   ALG_NSUB(ud) + 1);
+}
+
+static int test_exec (TPosix *ud, TArgExec *argE) {
+  argE->text += argE->startoffset;
+  return tre_exec (ud, argE->text, argE->textlen - argE->startoffset, argE->eflags,
+                   0);
 }
 
-static int gsub_exec (TPosix *ud, TArgExec *argE, int st) {
+static int gsub_exec (TPosix *ud, TArgExec *argE, size_t st) {
   if (st > 0)
     argE->eflags |= REG_NOTBOL;
-  return tre_regnexec (&ud->r, argE->text+st, argE->textlen-st, ALG_NSUB(ud)+1,
-                    ud->match, argE->eflags);
+  return tre_exec (ud, argE->text + st, argE->textlen - st, argE->eflags,
+                   ALG_NSUB(ud) + 1);
 }
 
-static int split_exec (TPosix *ud, TArgExec *argE, int offset) {
+static int split_exec (TPosix *ud, TArgExec *argE, size_t offset) {
   if (offset > 0)
     argE->eflags |= REG_NOTBOL;
-  return tre_regnexec (&ud->r, argE->text + offset, argE->textlen - offset,
-                   ALG_NSUB(ud) + 1, ud->match, argE->eflags);
+  return tre_exec (ud, argE->text + offset, argE->textlen - offset, argE->eflags,
+                   ALG_NSUB(ud) + 1);
 }
 
 static int Ltre_have_backrefs (lua_State *L) {
@@ -212,6 +296,7 @@ static int Ltre_gc (lua_State *L) {
     ud->freed = 1;
     tre_regfree (&ud->r);
     Lfree (L, ud->match, (ALG_NSUB(ud) + 1) * sizeof (regmatch_t));
+    literal_free (L, &ud->lit);
   }
   return 0;
 }
@@ -316,6 +401,13 @@ static const luaL_Reg r_methods[] = {
   { "exec",          algm_exec },
   { "find",          algm_find },
   { "match",         algm_match },
+  { "test",          algm_test },
+  { "search",        algm_search },
+  { "find_all",      algm_find_all },
+  { "grep",          algm_grep },
+  { "test_batch",    algm_test_batch },
+  { "exec_batch",    algm_exec_batch },
+  { "count_batch",   algm_count_batch },
   { "tfind",         algm_tfind },
   { "aexec",         Ltre_aexec },
   { "atfind",        Ltre_atfind },
@@ -328,7 +420,13 @@ static const luaL_Reg r_methods[] = {
 
 static const luaL_Reg r_functions[] = {
   { "new",           algf_new },
+  { "cache_stats",   algf_cache_stats },
+  { "cache_clear",   algf_cache_clear },
+  { "cache_config",  algf_cache_config },
   { "find",          algf_find },
+  { "test",          algf_test },
+  { "search",        algf_search },
+  { "find_all",      algf_find_all },
   { "gmatch",        algf_gmatch },
   { "gsub",          algf_gsub },
   { "count",         algf_count },
@@ -128,7 +128,7 @@ static int generic_atfind (lua_State *L, int tfind) {
   regamatch_t res_match;
 
   checkarg_atfind (L, &argE, &ud, &argP);
-  if (argE.startoffset > (int)argE.textlen)
+  if (argE.startoffset > argE.textlen)
     return lua_pushnil(L), 1;
 
   argE.text += argE.startoffset;
@@ -141,9 +141,9 @@ static int generic_atfind (lua_State *L, int tfind) {
   if (ALG_ISMATCH (res)) {
     ALG_PUSHOFFSETS (L, ud, argE.startoffset, 0);
     if (tfind)
-      push_substring_table (L, ud, argE.text);
+      push_substring_table (L, ud, argE.text, 0);
     else
-      push_offset_table (L, ud, argE.startoffset);
+      push_offset_table (L, ud, argE.startoffset, 0);
     /* set values in the dictionary part of the table */
     set_int_field (L, "cost", res_match.cost);
     set_int_field (L, "num_ins", res_match.num_ins);
@@ -173,8 +173,9 @@ static int gmatch_exec (TUserdata *ud, TArgExec *argE) {
                    ALG_NSUB(ud) + 1, ud->match, argE->eflags);
 }
 
-static void gmatch_pushsubject (lua_State *L, TArgExec *argE) {
-  lua_pushlstring (L, argE->text, argE->textlen);
+static void gmatch_pushsubject (lua_State *L, TArgExec *argE, int pos) {
+  (void)argE;
+  lua_pushvalue (L, pos);
 }
 
 static int findmatch_exec (TPosix *ud, TArgExec *argE) {
@@ -183,14 +184,14 @@ static int findmatch_exec (TPosix *ud, TArgExec *argE) {
                    ALG_NSUB(ud) + 1, ud->match, argE->eflags);
 }
 
-static int gsub_exec (TPosix *ud, TArgExec *argE, int st) {
+static int gsub_exec (TPosix *ud, TArgExec *argE, size_t st) {
   if (st > 0)
     argE->eflags |= REG_NOTBOL;
   return tre_regwnexec (&ud->r, (const wchar_t*)(argE->text+st), (argE->textlen-st)/ALG_CHARSIZE, ALG_NSUB(ud)+1,
                     ud->match, argE->eflags);
 }
 
-static int split_exec (TPosix *ud, TArgExec *argE, int offset) {
+static int split_exec (TPosix *ud, TArgExec *argE, size_t offset) {
   if (offset > 0)
     argE->eflags |= REG_NOTBOL;
   return tre_regwnexec (&ud->r, (const wchar_t*)(argE->text + offset), (argE->textlen - offset)/ALG_CHARSIZE,
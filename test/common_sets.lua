@@ -38,6 +38,59 @@ local function set_f_gmatch (lib, flg)
   }
 end
 
+local function set_m_search (lib, flg)
+  -- rex.search (s, p, [st], [cf], [ef]); r:search (s, [st], [ef])
+  local function test_search (subj, patt, st, i, shrink)
+    if shrink then -- a buffer subject that gets shorter after the search
+      if type (subj) == "string" then subj = lib._newmembuffer (subj) end
+      local m = lib.search (subj, patt, st)
+      getmetatable (subj).__len = function () return shrink end
+      return m[i]
+    end
+    local m = lib.search (subj, patt, st)
+    local m2 = lib.new (patt):search (subj, st)
+    if not m then return m2 end
+    assert (m2[i] == m[i])
+    local a, b = m:span (i)
+    return #m, m[i], a, b
+  end
+  return {
+    Name = "Function search, method search",
+    Func = test_search,
+  --{subj,   patt,          st, i, shrink},  { results }
+    { {"abcd", "(.)b.(d)",  N,  0},  { 2, "abcd", 1, 4 } },
+    { {"abcd", "(.)b.(d)",  N,  2},  { 2, "d", 4, 4 } },
+    { {"abcd", "(.)b.(d)",  N,  3},  { 2, N, N, N } },
+    { {"abcd", ".+",        -2, 0},  { 0, "cd", 3, 4 } },
+    { {"abcd", "(x)|b",     N,  1},  { 1, false, false, false } },
+    { {"abcd", "x"},                 { N } },
+    { {"abcd", "(.)b.(d)",  N,  1, 3},  { "a" } },
+    { {"abcd", "(.)b.(d)",  N,  2, 3},  "subject is shorter than the match" },
+  }
+end
+
+local function set_f_find_all (lib, flg)
+  -- find_all (s, p, [cf], [ef], [max], [caps]); r:find_all (s, [ef], [max], [caps])
+  local function test_find_all (subj, patt, max, caps)
+    local t, n = lib.find_all (subj, patt, nil, nil, max, caps)
+    local t2, n2 = lib.new (patt):find_all (subj, nil, max, caps)
+    assert (n2 == n and #t2 == #t)
+    return t, n
+  end
+  return {
+    Name = "Function find_all",
+    Func = test_find_all,
+  --{  subj             patt        max, caps}, { results }
+    { {"ab",            "."},                   { {1,1,2,2}, 2 } },
+    { {("abcd"):rep(3), "(.)b.(d)", N,   true}, { {1,4,1,1,4,4, 5,8,5,5,8,8, 9,12,9,9,12,12}, 3 } },
+    { {"abcd",          ".*"},                  { {1,4}, 1 } },--zero-length match
+    { {"abc",           "^."},                  { {1,1}, 1 } },--anchored pattern
+    { {"axxb",          "x*"},                  { {1,0,2,3,5,4}, 3 } },
+    { {"abab",          "b",        1},         { {2,2}, 1 } },--max
+    { {"ac",            "(a)|(c)",  N,   true}, { {1,1,1,1,false,false, 2,2,false,false,2,2}, 2 } },
+  }
+end
+
 local function set_f_count (lib, flg)
   return {
     Name = "Function count",
@@ -50,6 +103,57 @@ local function set_f_count (lib, flg)
   }
 end
 
+local function set_f_buffer (lib, flg)
+  -- subjects read through the C buffer protocol rather than topointer
+  local function test_buffer (subj, patt)
+    if type (subj) == "string" and lib._newmembuffer then
+      subj = lib._newmembuffer (subj, true)
+      getmetatable (subj).topointer = function () error "topointer called" end
+    end
+    local out = { lib.count (subj, patt), lib.find (subj, patt) }
+    for a in lib.gmatch (subj, patt) do table.insert (out, a) end
+    return unpack (out)
+  end
+  return {
+    Name = "Buffer subjects",
+    Func = test_buffer,
+  --{  subj             patt         results }
+    { {"ab",            "."},        { 2, 1, 1, "a", "b" } },
+    { {("abcd"):rep(2), "(.)d"},     { 2, 3, 4, "c", "c", "c" } },
+    { {"",              "x"},        { 0 } },
+  }
+end
+
+local function set_f_mmap (lib, flg)
+  -- mmap (path, [offset], [length])
+  local function test_mmap (subj, patt, offset, length)
+    if type (subj) ~= "string" then -- a buffer subject: read it back
+      subj = (lib.gsub (subj, "$", ""))
+    end
+    local path = os.tmpname ()
+    local f = assert (io.open (path, "wb"))
+    f:write (subj)
+    f:close ()
+    local m, err = lib.mmap (path, offset, length)
+    os.remove (path)
+    if not m then error (err) end
+    local out = { #m, lib.count (m, patt), lib.find (m, patt) }
+    m:close ()
+    table.insert (out, (pcall (lib.find, m, patt)))
+    return unpack (out)
+  end
+  return {
+    Name = "Function mmap",
+    Func = test_mmap,
+  --{  subj             patt   offset, length}, { results }
+    { {"abcabc",        "b"},                   { 6, 2, 2, 2, false } },
+    { {"abcabc",        "b",   2},              { 4, 1, 3, 3, false } },
+    { {"abcabc",        "c",   1,      2},      { 2, 1, 2, 2, false } },
+    { {"abc",           "x",   3},              { 0, 0, false } },
+    { {"abc",           "x",   4},              "offset past the end" },
+  }
+end
+
 local function set_f_split (lib, flg)
   -- split (s, p, [cf], [ef])
   local function test_split (subj, patt)
@@ -111,6 +215,32 @@ local function set_f_match (lib, flg)
   }
 end
 
+local function set_m_grep (lib, flg)
+  -- r:grep (s, [opts], [max], [ef])
+  local function test_grep (subj, patt, opts, max)
+    return lib.new (patt):grep (subj, opts, max)
+  end
+  local text = "one\ntwo\nthree\n"
+  return {
+    Name = "Method grep",
+    Func = test_grep,
+  --{  subj       patt     opts, max}, { results }
+    { {text,      "o"},               { {1,2} } },
+    { {text,      "o",     "v"},      { {3} } },
+    { {text,      "o",     "c"},      { 2 } },
+    { {text,      "o",     "vc"},     { 1 } },
+    { {text,      "e",     N,    1},  { {1} } },
+    { {text,      "t",     "s"},      { {2,3}, {5,9}, {7,13} } },
+    { {text,      "e\nt"},            { {} } },--no match across lines
+    { {text,      "^t"},              { {2,3} } },--anchors at the ends of lines
+    { {text,      "e$",    "c"},      { 2 } },
+    { {"a\n\nb", "x*"},              { {1,2,3} } },--empty matches
+    { {"a\n",     "x*"},              { {1} } },
+    { {"",        "x*",    "c"},      { 0 } },
+    { {text,      "o",     "x"},      "unknown option" },
+  }
+end
+
 local function set_m_exec (lib, flg)
   return {
     Name = "Method exec",
@@ -140,6 +270,23 @@ local function set_m_tfind (lib, flg)
   }
 end
 
+local function set_m_out_table (lib, flg)
+  -- r:exec (s, [st], [ef], [out]); r:tfind (s, [st], [ef], [out])
+  local function test_out (subj, patt, method, out)
+    local r = lib.new (patt)
+    local a, b, t = r[method] (r, subj, nil, nil, out)
+    return a, b, t == out, t, t.n
+  end
+  return {
+    Name = "Methods exec and tfind with a result table",
+    Func = test_out,
+  --{subj,   patt,         method,  out},                  { results }
+    { {"abcd", "(.)b.(d)", "exec",  {7,7,7,7,7,7}},        {1,4,true,{1,1,4,4},N} },
+    { {"abcd", "(.)b.(d)", "tfind", {"x",n="y"}},          {1,4,true,{"a","d"},"y"} },
+    { {"abcd", "b",        "exec",  {1,2}},                {2,2,true,{},N} },
+  }
+end
+
 local function set_m_find (lib, flg)
   return {
     Name = "Method find",
@@ -168,6 +315,33 @@ local function set_m_match (lib, flg)
   }
 end
 
+local function set_f_test (lib, flg)
+  return {
+    Name = "Function test",
+    Func = lib.test,
+  --  {subj, patt, st},         { results }
+    { {"abcd", lib.new".+"},    { true }  }, -- [none]
+    { {"abcd", ".+", 2},        { true }  }, -- positive st
+    { {"abcd", ".+", 5},        { false } }, -- failing st
+    { {"abcd", "x"},            { false } }, -- [none]
+    { {"abc",  "bc"},           { true }  }, -- [none]
+    { {"",     "x*"},           { true }  }, -- empty match
+    { {"abcd", "(.)b.(d)"},     { true }  }, -- [captures]
+  }
+end
+
+local function set_m_test (lib, flg)
+  return {
+    Name = "Method test",
+    Method = "test",
+  --{patt},                 {subj, st}           { results }
+    { {".+"},               {"abcd"},            { true }  }, -- [none]
+    { {".+"},               {"abcd",-2},         { true }  }, -- negative st
+    { {"bc"},               {"abc",3},           { false } }, -- positive st
+    { {"(.)b.(d)"},         {"abcd"},            { true }  }, -- [captures]
+  }
+end
+
 local function set_f_gsub1 (lib, flg)
   local subj, pat = "abcdef", "[abef]+"
   local cpat = lib.new(pat)
@@ -310,6 +484,47 @@ local function set_f_gsub8 (lib, flg)
   }
 end
 
+local function set_f_cache (lib, flg)
+  local function test_cache (subj, capacity, ...)
+    local cap, maxbytes = lib.cache_config ()
+    lib.cache_clear ()
+    lib.cache_config (capacity)
+    local s0 = lib.cache_stats ()
+    for _, patt in ipairs {...} do
+      lib.find (subj, patt)
+    end
+    local s1 = lib.cache_stats ()
+    lib.cache_config (cap, maxbytes)
+    return s1.count, s1.hits-s0.hits, s1.misses-s0.misses, s1.evictions-s0.evictions
+  end
+  return {
+    Name = "Function cache",
+    Func = test_cache,
+  --{subj, capacity, patterns...},              { count,hits,misses,evictions }
+    { {"abc", 8, "a", "b", "a", "a"},           { 2, 2, 2, 0 } },
+    { {"abc", 2, "a", "b", "c", "a"},           { 2, 0, 4, 2 } },
+    { {"abc", 2, "a", "b", "a", "c", "a"},      { 2, 2, 3, 1 } },
+    { {"abc", 0, "a", "a", "a"},                { 0, 0, 0, 0 } },
+  }
+end
+
+local function set_m_batch (lib, flg)
+  -- r:test_batch (subjects, [ef]); r:exec_batch (...); r:count_batch (...)
+  local function test_batch (subj1, patt, ...)
+    local r, subjects = lib.new (patt), {subj1, ...}
+    local starts, ends = r:exec_batch (subjects)
+    return r:test_batch (subjects), starts, ends, r:count_batch (subjects)
+  end
+  return {
+    Name = "Method test_batch, exec_batch, count_batch",
+    Func = test_batch,
+  --{subj1,    patt,    subjects...},  { test, starts, ends, counts }
+    { {"abcd", "b",     "xyz", "bb"},  { {true,false,true}, {2,false,1}, {2,false,1}, {1,0,2} } },
+    { {"",     "x*"},                  { {true}, {1}, {0}, {1} } },
+    { {"abc",  "^."},                  { {true}, {1}, {1}, {1} } },
+  }
+end
+
 return function (libname)
   local lib = require (libname)
   return {
@@ -319,9 +534,17 @@ return function (libname)
     set_f_match     (lib),
     set_m_exec      (lib),
     set_m_tfind     (lib),
+    set_m_out_table (lib),
     set_m_find      (lib),
     set_m_match     (lib),
+    set_f_test      (lib),
+    set_m_test      (lib),
+    set_m_search    (lib),
+    set_f_find_all  (lib),
     set_f_count     (lib),
+    set_f_buffer    (lib),
+    set_f_mmap      (lib),
+    set_m_grep      (lib),
     set_f_gsub1     (lib),
     set_f_gsub2     (lib),
     set_f_gsub3     (lib),
@@ -329,5 +552,7 @@ return function (libname)
     set_f_gsub5     (lib),
     set_f_gsub6     (lib),
     set_f_gsub8     (lib),
+    set_f_cache     (lib),
+    set_m_batch     (lib),
   }
 end
@@ -42,11 +42,24 @@ return {
 }
 end
 
+local function set_f_literal (lib, flg)
+return {
+  Name = "Required literals",
+  Func = lib.gsub,
+  --{s,          p,          f},            { r,       nm, ns }
+  { {"xxabcxabcd", "abcd?",  "-"},          { "xx-x-",  2,  2 } }, -- prefix
+  { {"xcdx",     "ab|cd",    "-"},          { "x-x",    1,  1 } }, -- alternation
+  { {"ab abab",  "(ab)+c?",  "-"},          { "- -",    2,  2 } }, -- group
+  { {"abd",      "abc",      "-"},          { "abd",    0,  0 } }, -- no literal
+}
+end
+
 return function (libname)
   local lib = require (libname)
   local flags = lib.flags ()
   return {
     set_f_match     (lib, flags),
     set_f_gmatch    (lib),
+    set_f_literal   (lib, flags),
   }
 end
@@ -0,0 +1,224 @@
+-- See Copyright Notice in the file LICENSE
+
+local luatest = require "luatest"
+local N = luatest.NT
+local unpack = unpack or table.unpack
+
+local function set_f_bundle (lib, flg)
+  -- save_bundle (path, regexes), load_bundle (path, [jit])
+  local function test_bundle (subj, patt, cf, jit, cut)
+    local path = os.tmpname ()
+    local ok, err = lib.save_bundle (path, { lib.new ("x"), lib.new (patt, cf) })
+    local t
+    if ok and cut then -- truncate the file by cut bytes
+      local f = assert (io.open (path, "rb"))
+      local data = f:read ("*a")
+      f:close ()
+      f = assert (io.open (path, "wb"))
+      f:write (data:sub (1, -cut-1))
+      f:close ()
+    end
+    if ok then
+      t, err = lib.load_bundle (path, jit)
+    end
+    os.remove (path)
+    if not t then
+      error (err)
+    end
+    return #t, t[2]:find (subj)
+  end
+  return {
+    Name = "Function save_bundle/load_bundle",
+    Func = test_bundle,
+  --{subj,     patt,        cf,  jit, cut}, { results }
+    { {"abcd",  "b(.)"},                    { 2, 2,3,"c" } },
+    { {"aBcd",  "b(.)",     "i"},           { 2, 2,3,"c" } },
+    { {"abcd",  "x"},                       { 2, N } },
+    { {"abcd",  "(?<n>c)d", N,   true},     { 2, 3,4,"c" } },
+    { {"abcd",  "b(.)",     N,   N,   1},   "bundle file is corrupted" },
+  }
+end
+
+local function set_f_jit_policy (lib, flg)
+  -- set_jit_policy { [mode], [threshold] }
+  local function test_jit (subj, patt, mode, threshold, nexec)
+    lib.set_jit_policy { mode = mode, threshold = threshold }
+    local r = lib.new (patt)
+    local a, b
+    for i = 1, nexec do
+      a, b = r:find (subj)
+    end
+    lib.set_jit_policy { mode = "never" }
+    return a, b, r:patterninfo ().JITSIZE > 0
+  end
+  local jit = lib.config ().PCRE2_CONFIG_JIT == 1
+  return {
+    Name = "Function set_jit_policy",
+    Func = test_jit,
+  --{subj,       patt,  mode,      threshold, nexec},   { results }
+    { {"abcd",   "b.",  "never",    N,        1},       { 2,3,false } },
+    { {"abcd",   "b.",  "always",   N,        1},       { 2,3,jit   } },
+    { {"b",      "b",   "adaptive", 3,        2},       { 1,1,false } },
+    { {"b",      "b",   "adaptive", 3,        4},       { 1,1,jit   } }, -- executions
+    { {"abcdef", "b.",  "adaptive", 6,        1},       { 2,3,jit   } }, -- bytes
+  }
+end
+
+local function set_f_jit_stack (lib, flg)
+  -- config_jit_stack ([startsize], [maxsize])
+  local function test_jit_stack (subj, patt, startsize, maxsize)
+    local start0, max0 = lib.config_jit_stack ()
+    lib.config_jit_stack (startsize, maxsize)
+    local r = lib.new (patt)
+    r:jit_compile ()
+    local ok, a, b = pcall (r.find, r, subj)
+    lib.config_jit_stack (start0, max0)
+    return ok, a, b
+  end
+  local jit = lib.config ().PCRE2_CONFIG_JIT == 1
+  local subj = ("ab"):rep (100000) .. "c"
+  return {
+    Name = "Function config_jit_stack",
+    Func = test_jit_stack,
+  --{subj,  patt,      startsize, maxsize},      { results }
+    { {subj, "(a|b)*c", 32*1024,   32*1024},      jit and { false, "error PCRE2_ERROR_JIT_STACKLIMIT", N } or { true, 1, #subj } },
+    { {subj, "(a|b)*c", 32*1024,   32*1024*1024}, { true, 1, #subj } },
+  }
+end
+
+local function set_f_limits (lib, flg)
+  -- find (s, p, [st], [cf], [ef], [lo], [limits]), set_default_limits (limits)
+  local function test_limits (subj, patt, limits, defaults)
+    if defaults then lib.set_default_limits (defaults) end
+    local ok, a, b = pcall (lib.find, subj, patt, 1, nil, nil, nil, limits)
+    if defaults then lib.set_default_limits { match_limit=0, depth_limit=0, heap_limit=0 } end
+    return ok, a, b
+  end
+  local s1, p1 = ("a"):rep (20) .. "b", "(a+)+$"
+  local s2, p2 = ("ab"):rep (5000), "(?:(a)|b)*\\d"
+  local ver = tonumber (lib.version ():match ("%d+%.%d+"))
+  local set = {
+    Name = "Function find with limits",
+    Func = test_limits,
+  --{subj, patt, limits,                  defaults},              { results }
+    { {s1, p1,   N,                       N},                     { true, N, N } },
+    { {s1, p1,   {match_limit=1000},      N},                     { false, "error PCRE2_ERROR_MATCHLIMIT", N } },
+    { {s1, p1,   N,                       {match_limit=1000}},    { false, "error PCRE2_ERROR_MATCHLIMIT", N } },
+    { {s1, p1,   {match_limit=0},         {match_limit=1000}},    { true, N, N } },
+    { {s1, p1,   {match_limit=-1},        N},                     { false, "bad value of the limit 'match_limit'", N } },
+    { {"ab", "b", {match_limit=1000},     N},                     { true, 2, 2 } },
+  }
+  if ver >= 10.3 then
+    table.insert (set, { {s2, p2, {depth_limit=10}, N}, { false, "error PCRE2_ERROR_DEPTHLIMIT", N } })
+    table.insert (set, { {s2, p2, {heap_limit=1},   N}, { false, "error PCRE2_ERROR_HEAPLIMIT", N } })
+  end
+  return set
+end
+
+local function set_f_gsub_template (lib, flg)
+  -- gsub (s, p, f, [n], [cf], [ef]), string templates made by pcre2_substitute
+  local long = ("ab"):rep (1000)
+  return {
+    Name = "Function gsub (string templates)",
+    Func = lib.gsub,
+  --{ s,          p,        f,         n,  cf, ef},     { r,         nm, ns }
+    { {"a$b",     "\\$",    "$1$"},                     { "a$1$b",   1,  1 } },
+    { {"ab",      "(a)(x)?","[%2%1]"},                  { "[a]b",    1,  1 } },
+    { {"abab",    "b",      "%0%0%%"},                  { "abb%abb%",2,  2 } },
+    { {long,      "b",      "bbbbb"},                   { long:gsub ("b", "bbbbb"), 1000, 1000 } },
+    { {"abc",     "b*",     "-"},                       { "-a-c-",   3,  3 } },
+    { {"abab",    "b",      "x",       1},              { "axab",    1,  1 } },
+  }
+end
+
+local function set_f_utf_check (lib, flg)
+  -- gsub (s, p, f, [n], [cf]), with the subject validated once
+  local function test_utf (subj, patt, repl, st)
+    local r = lib.new (patt, flg.UTF)
+    local a, b = lib.gsub (subj, r, repl)
+    return a, b, r:find (subj, st)
+  end
+  local long = ("\195\169t\195\169 "):rep (500)
+  return {
+    Name = "UTF subjects",
+    Func = test_utf,
+  --{subj,                  patt,  repl, st},   { results }
+    { {"h\195\169llo",     "l",   "L"},        { "h\195\169LLo", 2, 4,4 } },
+    { {long,                "t",   "T",  -4},   { long:gsub ("t", "T"), 500, 2997,2997 } },
+    { {"h\255llo",          "l",   "L"},        "error PCRE2_ERROR_UTF8_ERR21" },
+    { {"h\195\169llo",     "l",   "L",  3},    "error PCRE2_ERROR_BADUTFOFFSET" },
+    { {"\195\169\195\169",  "x*",  "-"},        { "-\195\169-\195\169-", 3, 1,0 } },
+  }
+end
+
+local function set_f_stream (lib, flg)
+  -- r:stream ([ef]); st:feed (chunk); st:finish ()
+  local function test_stream (chunk1, patt, ...)
+    local st = lib.new (patt):stream ()
+    local out = {}
+    for _, chunk in ipairs {chunk1, ...} do
+      for _, m in ipairs (st:feed (chunk)) do table.insert (out, m) end
+    end
+    for _, m in ipairs (st:finish ()) do table.insert (out, m) end
+    return unpack (out)
+  end
+  return {
+    Name = "Method stream",
+    Func = test_stream,
+  --{ chunk1,  patt,        chunks... },          { results }
+    { {"xxfo",  "foo(bar)?", "obarxxfoo", "b", "a"}, { {3,8,6,8}, {11,13,false,false} } },
+    { {"12",    "\\d+",      "34 5", "6"},           { {1,4}, {6,7} } },
+    { {"xa",    "(?<=a)b",   "b"},                   { {3,3} } },
+    { {"ab",    "abc$",      "c"},                   { {1,3} } },
+    { {"ax",    "x*",        "xb"},                  { {1,0}, {2,3}, {5,4} } },
+  }
+end
+
+local function set_f_set (lib, flg)
+  -- set (patterns, [cf]); set:match (s, [st]); set:first (s, [st])
+  local function test_set (subj, st, cf, ...)
+    local set = lib.set ({...}, cf)
+    return set:match (subj, st), set:first (subj, st)
+  end
+  local many = {}
+  for i = 1, 3000 do many[i] = "x" .. i .. "(?<n>y+)" end
+  return {
+    Name = "Function set",
+    Func = test_set,
+  --{ subj,          st, cf,  patterns... },                    { match, first, s, e }
+    { {"/users/42",   N,  N,   "^/users/\\d+$", "^/users/", "x", "\\d"}, { {1,2,4}, 1, 1, 9 } },
+    { {"/users/42",   2,  N,   "^/users/\\d+$", "users", "\\d"},      { {2,3}, 2, 2, 6 } },
+    { {"a) b",        N,  N,   "\\Qa)", "b"},                         { {1,2}, 1, 1, 2 } },
+    { {"abc",         N,  N,   "x", "y"},                             { {}, N } },
+    { {"x2999yy",     N,  N,   unpack (many)},                        { {2999}, 2999, 1, 7 } },
+    { {"bc",          N,  "x", "a # a comment", "b c"},               { {2}, 2, 1, 2 } },
+    { {"abc",         N,  N,   "a", "(b)\\1"},                        "back references" },
+    { {"abc",         N,  N,   "a", "b)"},                            "unmatched" },
+    { {"abc",         N,  N,   "a", "(?x)b # a comment"},             "cannot be joined" },
+    { {"abc",         N,  N,   "a", "(*UTF)b"},                       "verbs" },
+    { {"abc",         N,  N,   "a(*COMMIT)x", "b"},                   "verbs" },
+    { {"abc",         N,  N,   "a", "b(*ACCEPT)"},                    "verbs" },
+    { {"abc",         N,  N,   "a(*:m)", "b"},                        "verbs" },
+    { {"abc",         N,  N,   "(?<n>a)(?1)", "b"},                   "by number" },
+    { {"abc",         N,  N,   "a", "(?<n>a)?(?(1)b|c)"},             "by number" },
+    { {"abc",         N,  N,   "(?<n>a)", "(?<n>b)(?&n)"},            "by name" },
+    { {"abc",         N,  N,   "(?<n>a)", "(?P<n>b)(?P>n)"},          "by name" },
+    { {"abc",         N,  N,   "(?<n>a)", "(?<n>b)\\g<n>"},           "by name" },
+    { {"a*b",         N,  N,   "(*atomic:a)", "[(*]b"},               { {1,2}, 1, 1, 1 } },
+  }
+end
+
+return function (libname)
+  local lib = require (libname)
+  local flags = lib.flags ()
+  return {
+    set_f_bundle    (lib, flags),
+    set_f_jit_policy (lib, flags),
+    set_f_jit_stack (lib, flags),
+    set_f_limits    (lib, flags),
+    set_f_utf_check (lib, flags),
+    set_f_gsub_template (lib, flags),
+    set_f_stream    (lib, flags),
+    set_f_set       (lib, flags),
+  }
+end
@@ -17,12 +17,33 @@ local function set_named_subpatterns (lib, flg)
     Name = "Named Subpatterns",
     Func = function (subj, methodname, patt, name1, name2)
       local r = lib.new (patt)
-      local _,_,caps = r[methodname] (r, subj)
+      local m,_,caps = r[methodname] (r, subj)
+      if methodname == "search" then caps = m end
       return norm(caps[name1]), norm(caps[name2])
     end,
     --{} N.B. subject is always first element
     { {"abcd", "tfind", "(?P<dog>.)b.(?P<cat>d)", "dog", "cat"},  {"a","d"} },
     { {"abcd", "exec",  "(?P<dog>.)b.(?P<cat>d)", "dog", "cat"},  {"a","d"} },
+    { {"abcd", "search","(?P<dog>.)b.(?P<cat>d)", "dog", "cat"},  {"a","d"} },
+    { {"xb",   "tfind", "(?J)(?<n>a)|(?<n>b)",    "n",   "n"},    {"b","b"} }, -- duplicate names
+  }
+end
+
+local function set_m_out_table (lib, flg)
+  -- r:exec (s, [st], [ef], [out]); r:dfa_exec (s, [st], [ef], [ovecsize], [wscount], [out])
+  local function test_out (subj, patt, subj2)
+    local r, out = lib.new (patt), {}
+    local _, _, t1 = r:tfind (subj, nil, nil, out)
+    local a = out.n
+    local _, _, t2 = r:tfind (subj2, nil, nil, out)
+    local _, t3 = r:dfa_exec (subj2, nil, nil, nil, nil, out)
+    return t1 == out and t2 == out and t3 == out, a, out.n, #out
+  end
+  return {
+    Name = "Result table reuse",
+    Func = test_out,
+  --{subj,  patt,               subj2},   { results }
+    { {"ab", "(?P<n>a)|(?P<m>b)", "b"},   { true, "a", false, 1 } },
   }
 end
 
@@ -33,13 +54,17 @@ local function set_f_find (lib, flg)
   return {
   Name = "Function find",
   Func = lib.find,
-  --{subj,   patt,      st,cf,ef,lo},        { results }
+  --{subj,   patt,      st,cf,ef,lo,limits}, { results }
   { {"abcd", ".+",      5},                  { N   } }, -- failing st
   { {"abcd", ".*?"},                         { 1,0 } }, -- non-greedy
   { {"abc",  "aBC",     N,flg.CASELESS},     { 1,3 } }, -- cf
   { {"abc",  "aBC",     N,"i"         },     { 1,3 } }, -- cf
   { {"abc",  "bc",      N,flg.ANCHORED},     { N   } }, -- cf
   { {"abc",  "bc",      N,N,flg.ANCHORED},   { N   } }, -- ef
+  { {"abc",  "B",       N,"i",N,"C"},        { 2,2 } }, -- locale
+  { {"abc",  "b",       N,N,N,"no_such.locale"}, "cannot set locale" }, -- locale
+  { {"abc",  "b",       N,N,N,N,{match_limit=1000}}, { 2,2 } }, -- limits
+  { {("a"):rep(20).."b", "(a+)+$", N,N,N,N,{match_limit=1000}}, "error PCRE_ERROR_MATCHLIMIT" }, -- limits
 --{ {cp1251, "[[:upper:]]+", N,N,N, loc},    { 1,33} }, -- locale
 --{ {cp1251, "[[:lower:]]+", N,N,N, loc},    {34,66} }, -- locale
 }
@@ -167,15 +192,55 @@ local function set_m_dfa_exec (lib, flg)
 }
 end
 
+local function set_m_dfa_gmatch (lib, flg)
+  -- r:dfa_gmatch (s, [ef], [ovecsize], [wscount])
+  local function test_dfa_gmatch (subj, patt)
+    local r = lib.new (patt)
+    local out = {}
+    for m in r:dfa_gmatch (subj) do
+      table.insert (out, m)
+    end
+    local st = r:find (subj) -- matching after dfa_gmatch
+    table.insert (out, norm(st))
+    return unpack (out)
+  end
+  return {
+    Name = "Method dfa_gmatch",
+    Func = test_dfa_gmatch,
+  --{  subj         patt      results }
+    { {"aaxbaab",   "a+|b"},  {"aa","b","aa","b",1} },
+    { {"axxb",      "x*"},    {"","xx","",1} },
+    { {"abc",       "d"},     {N} },
+  }
+end
+
 local function set_m_fullinfo (lib, flg)
   local r = lib.new("(foo)(bar)")
   local info = r:fullinfo()
   assert(info.CAPTURECOUNT == 2)
 end
 
+local function set_f_literal (lib, flg)
+  local long = ("ab"):rep (100)
+  return {
+  Name = "Literal patterns",
+  Func = lib.find,
+  --{subj,          patt,    st,cf,ef},          { results }
+  { {"xAbc abc",     "abc"},                     { 6,8 }     },
+  { {"xAbc abc",     "abc",   N, "i"},           { 2,4 }     }, -- cf
+  { {"axb a.b",      "a\\.b"},                   { 5,7 }     }, -- escape
+  { {"abcabc",       "abc",   2},                { 4,6 }     }, -- st
+  { {"abc",          "abc",   -2},               { N }       }, -- st
+  { {"abc abc",      "abc",   2, N, flg.ANCHORED}, { N }     }, -- ef
+  { {long.."abc",    "abc"},                     { 201,203 } }, -- long
+  { {long.."aBC",    "Abc",   N, "i"},           { 201,203 } }, -- long + cf
+  }
+end
+
 return function (libname)
   local lib = require (libname)
   local flags = lib.flags ()
+  set_m_fullinfo (lib, flags) -- checks only; returns no set
   local sets = {
     set_f_match  (lib, flags),
     set_f_find   (lib, flags),
@@ -183,13 +248,15 @@ return function (libname)
     set_f_split  (lib, flags),
     set_m_exec   (lib, flags),
     set_m_tfind  (lib, flags),
-    set_m_fullinfo (lib, flags),
+    set_f_literal (lib, flags),
   }
   if flags.MAJOR >= 4 then
     table.insert (sets, set_named_subpatterns (lib, flags))
   end
   if flags.MAJOR >= 6 then
     table.insert (sets, set_m_dfa_exec (lib, flags))
+    table.insert (sets, set_m_dfa_gmatch (lib, flags))
+    table.insert (sets, set_m_out_table (lib, flags))
   end
   return sets
 end
@@ -51,6 +51,24 @@ return {
 }
 end
 
+local function set_f_literal (lib, flg)
+return {
+  Name = "Required literals",
+  Func = lib.gsub,
+  --{s,          p,          f,   n, cf},    { r,       nm, ns }
+  { {"xxabcxabcd", "abcd?",  "-"},          { "xx-x-",  2,  2 } }, -- prefix
+  { {"xcdx",     "ab|cd",    "-"},          { "x-x",    1,  1 } }, -- alternation
+  { {"aaa b",    "ab*",      "-"},          { "--- b",  3,  3 } }, -- quantifier
+  { {"ab abab",  "(ab)+c?",  "-"},          { "- -",    2,  2 } }, -- group
+  { {"abc abc",  "^abc",     "-"},          { "- abc",  1,  1 } }, -- anchor
+  { {"abd",      "abc",      "-"},          { "abd",    0,  0 } }, -- no literal
+  { {"a]b ab",   "a[]]b",    "-"},          { "- ab",   1,  1 } }, -- bracket
+  { {"x1y 2y",   "[0-9]y",   "-"},          { "x- -",   2,  2 } }, -- inner literal
+  { {"aBc abc",  "abc",      "-", N, flg.ICASE + flg.EXTENDED}, { "- -", 2, 2 } },
+  { {("ab"):rep(100).."a.b", "a\\.b", "-"}, { ("ab"):rep(100).."-", 1, 1 } }, -- long
+}
+end
+
 return function (libname)
   local lib = require (libname)
   local flags = lib.flags ()
@@ -59,5 +77,6 @@ return function (libname)
     set_f_find   (lib, flags),
     set_m_exec   (lib, flags),
     set_m_tfind  (lib, flags),
+    set_f_literal (lib, flags),
   }
 end